@@ -1,10 +1,38 @@
 /* Program to generate text based on the context provided by input prompts.
+Statements are built into an automaton, which is compressed and completes 
+each prompt with the text most statements go on with. Options are listed 
+with -h, compile with -pthread. Compiled with -DAUTOMATON_LIBRARY, main is 
+left out and the library functions serve as an engine to embed.
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(AUTOMATON_SCALAR)
+#define SIMD_LOOKUP
+#include <emmintrin.h>
+/* Decided by cpuid unless every processor built for has SSE2 */
+#ifdef __SSE2__
+#define HAS_SSE2 1
+#else
+#define HAS_SSE2 __builtin_cpu_supports("sse2")
+#endif
+#endif
 
 #define SDELIM "==STAGE %d============================\n" 
 #define MDELIM "-------------------------------------\n"  
@@ -13,6 +41,9 @@
 #define NOCFMT "Number of characters: %d\n"
 #define NPSFMT "Number of states: %d\n"
 #define TFQFMT "Total frequency: %d\n"
+#define PHSFMT "{\"phase\": \"%s\", \"seconds\": %.6f, \"items\": %ld, " \
+               "\"unit\": \"%s\", \"items_per_second\": %.1f, " \
+               "\"peak_rss_kb\": %ld}\n"
 
 #define CRTRNC          '\r'      /* carriage return character */
 #define NEWLIN          '\n'      /* newline character */
@@ -24,12 +55,12 @@
 #define STAGE_2          2        /* stage number 2 */
 #define STMNT_END        1        /* end of statement */
 #define STAGE_END        2        /* end of stage */
+#define BAD_END          3        /* end of valid input */
 
 #define INT_ZER          0        /* integer 0 */
 #define INT_ONE          1        /* integer one */
 #define INT_TWO          2        /* integer two */
 #define INT_THR          3        /* integer three */
-#define INT_TEN          10       /* integer ten */
 #define FALSE            0        /* integer 0 for FALSE */
 #define TRUE             1        /* integer 1 for TRUE */
 #define LEFT             1        /* integer 1 for left */
@@ -37,757 +68,4848 @@
 
 #define OUTPUT_MAX       37       /* max number of output characters */
 #define ASCII_MAX        128      /* max range for ASCII character */
+#define CHAR_BITS        8        /* bits of a character */
+
+#define NIL              0        /* index of no node / no string */
+#define INIT_SLOTS       1024     /* initial capacity of each pool */
+#define INIT_CHARS       8192     /* initial capacity of string arena */
+#define STR_CLASSES      32       /* number of string size classes */
+#define STR_MIN_BITS     3        /* log2 of smallest string slot size */
+#define INLINE_MAX       4        /* max characters of an inline string */
+#define SMALL_MAX        16       /* max children in a small lookup */
+#define BIG_LOOKUP       0x80000000u /* flag marking a 128-slot lookup */
+#define NO_KEY           -1       /* key not in a small lookup */
+#define MEMO_MAX         1048576  /* max bytes of cached completions */
+#define READ_BLOCK       65536    /* bytes of input read at a time */
+#define NUM_MAX          32       /* max digits of number of compression */
+#define WRITE_BLOCK      65536    /* bytes of output written at a time */
+#define FORMAT_MAX       128      /* max bytes of a formatted output line */
+#define NO_FD            -1       /* no file descriptor */
+#define NO_TIMEOUT       -1       /* wait without time limit */
+#define BATCH_MAX        65536    /* max prompts answered at a time */
+#define THREADS_MAX      256      /* max number of threads */
+#define SNAP_MAGIC       "AUTOSNP4" /* first bytes of a snapshot file */
+#define MAGIC_LEN        8        /* number of bytes of SNAP_MAGIC */
+#define OUTPUT_LINE      (OUTPUT_MAX + 2) /* bytes of a completed prompt */
+#define BAD_PROMPT       -1       /* prompt out of ASCII range */
+#define MEMO_WAYS        4        /* cached completions per hash set */
+#define ANSWERS_MAX      1048576  /* max bytes of cached answers */
+#define ANSWER_WAYS      4        /* cached answers per hash set */
+#define KEY_CHARS        8        /* first characters of a prompt sort key */
+#define KEY_BITS         64       /* bits of a prompt sort key */
+#define DIGIT_BITS       11       /* bits of sort key sorted at a time */
+#define DIGITS           2048     /* values of those bits */
+#define TOP_MAX          64       /* max completions ranked for a prompt */
+#define NO_LIST          -1       /* no list above first one reached */
+#define REQUEST_MAX      1048576  /* max bytes of a request */
+#define CLIENTS_MAX      64       /* max clients connected at a time */
+#define HEADER_LEN       4        /* bytes of length before a message */
+#define OP_COMPLETE      'P'      /* request to complete a prompt */
+#define OP_COMPRESS      'C'      /* request to compress unless frozen */
+#define OP_APPEND        'A'      /* request to append statements */
+#define OP_QUIT          'Q'      /* request to stop server */
+#define STATUS_OK        0        /* request is done */
+#define STATUS_BAD       1        /* request cannot be done */
+#define JOB_NONE         0        /* no training request of a client */
+#define JOB_QUEUED       1        /* training request waits for writer */
+#define JOB_DONE         2        /* training request is published */
+#define PERCENT          100      /* whole of a percentage */
+#define PRINTABLE_MIN    '!'      /* first printable non-space character */
+#define PRINTABLE_NUM    94       /* number of printable non-space characters */
+#define PROMPT_SHARE     70       /* percent of prompts from a statement */
+#define PEAK_RESET       "5"      /* clear_refs value resetting peak RSS */
+#define GEN_STATEMENTS   100000   /* statements of a default corpus */
+#define GEN_MAX_LEN      40       /* max characters of a default statement */
+#define GEN_ALPHABET     26       /* characters of a default corpus */
+#define GEN_SHARE        50       /* percent of statements sharing a prefix */
+#define GEN_COMPRESS     1000     /* compression of a default corpus */
+#define GEN_PROMPTS      100000   /* prompts of each default stage */
+#define PHASES_MAX       10       /* max phases timed in a run */
+#define BENCH_LOOKUPS    65536    /* max small lookups timed with -t */
+#define CHECK_STEPS      4        /* spreads of keys checked in small lookups */
+#define DEPTH_BUCKETS    32       /* power of two buckets of leaf depth */
+#define STATS_STDERR     "-"      /* report path standing for stderr */
+
+/* Hot path counters, left out unless compiled with -DAUTOMATON_STATS */
+#define CNT_MATCH_HOPS   0        /* siblings stepped over matching prompts */
+#define CNT_INSERT_SHIFTS 1       /* keys shifted to keep a lookup sorted */
+#define CNT_VISITS       2        /* nodes taken from compression worklist */
+#define CNT_CHECKS       3        /* checks whether a node below can merge */
+#define CNT_SCANS        4        /* siblings scanned for compression */
+#define CNT_COMBINED     5        /* bytes copied combining strings */
+#define CNT_NODES        6        /* nodes allocated */
+#define CNT_LOOKUPS      7        /* child lookups allocated */
+#define CNT_STRS         8        /* long strings allocated */
+#define CNT_GROWS        9        /* times string arena grew */
+#define CNT_HITS         10       /* prompts answered from cache */
+#define CNT_RESUMED      11       /* prompt characters matched before */
+#define NUM_COUNTERS     12       /* number of counters */
+#define CNT_NAMES {"match_hops", "insert_shifts", "compress_visits", \
+                   "compress_checks", "compress_scans", "combined_bytes", \
+                   "node_allocs", "lookup_allocs", "str_allocs", \
+                   "arena_grows", "answer_hits", "resumed_chars"}
+#ifdef AUTOMATON_STATS
+#define COUNT(stats, counter, n) ((stats)->counts[counter] += (n))
+#else
+#define COUNT(stats, counter, n) ((void)0)
+#endif
 
 /* Data structure to record information about automaton ***********************/
-typedef struct state state_t;     /* a state for each node */
+typedef uint32_t ref_t;           /* index of a node in node array */
 typedef struct node  node_t;      /* a node in a linked list */
 
+/* Nodes refer to each other by 32-bit index, with freq inline. Transition 
+strings are not null terminated, short ones are held inline */
 struct node {
-    char*           str;          /* a transition string */
-    node_t*         down;         /* a link to node below */
-    node_t*         right;        /* a link to node on right */
-    node_t*         up;           /* a link to node above */
-    node_t*         left;         /* a link to node on left */
-    state_t*        state;        /* a state of this node */
+    ref_t           down;         /* a link to node below */
+    ref_t           right;        /* a link to node on right */
+    ref_t           left;         /* a link to node on left */
+    uint32_t        len;          /* length of transition string */
+    union {
+        uint32_t    str;          /* offset of a long string in arena */
+        char        chars[INLINE_MAX]; /* characters of a short string */
+    };
+    uint32_t        lookup;       /* child lookup of siblings anchored here */
+    int             freq;         /* frequency of node */
+    int             ends;         /* statements ending at node */
 };
 
 typedef struct { 
-    node_t*         head;         /* a pointer to root node */    
-    node_t*         tail;         /* a pointer to latest node */
+    ref_t           head;         /* index of root node */    
+    ref_t           tail;         /* index of latest node */
+    ref_t           anchor;       /* index of first node in tail's list */
 } list_t;
 
-struct state {
-    int             freq;         /* frequency of node */
-    int             visited;      /* visited state of node */
-};
+/* Path of latest statement, so that a statement sharing its first characters 
+resumes insertion where the two part */
+typedef struct {
+    char*           chars;        /* characters of latest statement */
+    ref_t*          nodes;        /* node of each character */
+    ref_t*          anchors;      /* first node in list of each node */
+    uint32_t        len;          /* number of characters */
+    uint32_t        max;          /* number of characters allocated */
+} path_t;
+
+/* Unary chains are merged into labels as statements are inserted and split 
+only when a branch appears. Merged nodes above each list keep their freq and 
+statements ending at them here so that a split brings them back as they would 
+have been. An automaton keeps them past construction and compression only to 
+have statements appended */
+typedef struct {
+    int             freq;         /* freq of merged node */
+    int             ends;         /* statements ending at merged node */
+} merged_t;
+
+typedef struct {
+    merged_t**      chains;       /* merged nodes by list anchor */
+    uint32_t        max;          /* number of anchors allocated */
+    char*           chars;        /* room to assemble a label */
+    uint32_t        max_chars;    /* number of characters allocated */
+} radix_t;
+
+typedef struct {
+    ref_t*          refs;         /* nodes waiting to be visited */
+    uint32_t        num;          /* number of nodes waiting */
+    uint32_t        max;          /* number of nodes allocated */
+} worklist_t;
 
 typedef struct {
     int             state;        /* total state in automaton */
     int             freq;         /* total frequency in automaton */ 
     int             statement;    /* total statement in automaton */
     int             character;    /* total character in automaton */
+    int             merged_state; /* states built merged, yet to count out */
+    int             merged_freq;  /* freq of those states */
 } total_t;
 
+/* Counters of work done on hot paths, all zero unless compiled in */
+typedef struct {
+    uint64_t        counts[NUM_COUNTERS]; /* count of each CNT_ counter */
+} stats_t;
+
+/* Siblings share all but their last character, which keys the lookup. A list
+of up to SMALL_MAX siblings keeps sorted keys, a longer one a direct table.
+Both cache the sibling to follow when generating text, a lone node is its own */
+typedef struct {
+    ref_t           best;         /* sibling with highest freq, then ASCII */
+    uint32_t        count;        /* number of siblings */
+    char            keys[SMALL_MAX]; /* last characters in ascending order */
+    ref_t           refs[SMALL_MAX]; /* sibling of each key */
+} small_t;
+
+typedef struct {
+    ref_t           best;         /* sibling with highest freq, then ASCII */
+    ref_t           refs[ASCII_MAX]; /* sibling of each last character */
+} big_t;
+
+/* Data structure to manage memory of automaton *****************************/
+typedef struct {
+    char*           slots;        /* contiguous array of slots */
+    size_t          size;         /* size of each slot in bytes */
+    uint32_t        num;          /* number of slots in use */
+    uint32_t        max;          /* number of slots allocated */
+    uint32_t        freed;        /* a list of released slots */
+} pool_t;
+
+typedef struct {
+    pool_t          nodes;        /* all nodes */
+    pool_t          smalls;       /* small child lookups */
+    pool_t          bigs;         /* big child lookups */
+    char*           chars;        /* contiguous arena of all strings */
+    uint32_t        num_chars;    /* number of arena bytes in use */
+    uint32_t        max_chars;    /* number of arena bytes allocated */
+    uint32_t        freed_str[STR_CLASSES]; /* released strings by class */
+    void*           map;          /* mapped snapshot holding all of above */
+    size_t          map_size;     /* size of mapped snapshot */
+} memory_t;
+
+/* A snapshot file is this header followed by node, small lookup, big lookup 
+and string arrays exactly as held in memory, then merged nodes if kept. 
+Everything refers to each other by index, so the file is mapped and used in 
+place */
+typedef struct {
+    char            magic[MAGIC_LEN]; /* SNAP_MAGIC */
+    uint32_t        node_size;    /* size of a node when written */
+    uint32_t        small_size;   /* size of a small lookup when written */
+    uint32_t        big_size;     /* size of a big lookup when written */
+    ref_t           head;         /* index of root node */
+    total_t         total;        /* state of automaton */
+    uint32_t        num_nodes;    /* number of node slots */
+    uint32_t        num_smalls;   /* number of small lookup slots */
+    uint32_t        num_bigs;     /* number of big lookup slots */
+    uint32_t        num_chars;    /* number of arena bytes */
+    uint32_t        freed_nodes;  /* a list of released node slots */
+    uint32_t        freed_smalls; /* a list of released small lookups */
+    uint32_t        freed_bigs;   /* a list of released big lookups */
+    uint32_t        freed_str[STR_CLASSES]; /* released strings by class */
+    uint32_t        kept;         /* whether merged nodes are kept */
+    uint32_t        num_merged;   /* number of words of merged nodes, each 
+                                  list anchor followed by its nodes */
+} snapshot_t;
+
+/* A frozen automaton keeps each list as a run of cells in key order, laid 
+out depth first with the cell to follow right after its parent's list, so that 
+generating text mostly reads on. Cell 0 stands above root list */
+typedef struct {
+    uint32_t        first;        /* first cell of list below */
+    uint32_t        shared;       /* start of characters shared by list below */
+    uint32_t        shared_len;   /* number of shared characters */
+    uint8_t         count;        /* number of cells in list below */
+    uint8_t         best;         /* cell to follow in list below from first */
+    char            key;          /* last character of label */
+} cell_t;
+
+typedef struct {
+    cell_t*         cells;        /* all cells */
+    char*           chars;        /* shared characters of all lists */
+    uint32_t        num;          /* number of cells */
+} frozen_t;
+
+/* Data structure to cache generated text **********************************/
+typedef struct {
+    ref_t           node;         /* node whose completion is cached */
+    uint32_t        used;         /* time of last use, 0 if slot is empty */
+    int             len;          /* number of characters in completion */
+    char            text[OUTPUT_MAX]; /* text generated below node */
+} completion_t;
+
+/* Completions are kept in sets of MEMO_WAYS by node, least recently used one
+of a full set is evicted, so memory stays within MEMO_MAX */
+typedef struct {
+    completion_t*   slots;        /* all cached completions */
+    uint32_t        num_sets;     /* number of hash sets, a power of two */
+    uint32_t        clock;        /* time of latest use */
+} memo_t;
+
+typedef struct {
+    int             prompt_len;   /* number of characters in prompt */
+    int             len;          /* number of characters in line */
+    char            prompt[OUTPUT_MAX]; /* characters of prompt */
+    char            line[OUTPUT_LINE]; /* line printed for prompt */
+} answer_t;
+
+/* Hashes and times of last use of a set of answers are kept apart from 
+answers, so that a prompt not cached is told so from a single cache line */
+typedef struct {
+    uint32_t        hashes[ANSWER_WAYS]; /* hash of prompt of each answer */
+    uint32_t        used[ANSWER_WAYS]; /* time of last use, 0 if empty */
+    uint32_t        stored;       /* bit of each answer holding its line */
+} tags_t;
+
+/* Lines printed for prompts are kept in sets of ANSWER_WAYS by prompt, least 
+recently used one of a full set is evicted, so memory stays within 
+ANSWERS_MAX. A prompt seen once only has its hash kept, its line is kept once 
+it is seen again, so prompts never repeated cost no more than their hash. No 
+more than OUTPUT_MAX characters of a prompt are printed, so only those tell 
+prompts apart */
+typedef struct {
+    tags_t*         tags;         /* tags of each set */
+    answer_t*       slots;        /* all cached answers */
+    uint32_t        num_sets;     /* number of hash sets, a power of two */
+    uint32_t        clock;        /* time of latest use */
+} answers_t;
+
+/* Data structure to rank completions *************************************/
+typedef struct {
+    ref_t           node;         /* a sibling */
+    int             freq;         /* most statements ending at a node of it */
+} rank_t;
+
+typedef struct {
+    uint32_t        first;        /* first sibling of list among ranks */
+    uint32_t        count;        /* number of siblings */
+} run_t;
+
+/* Siblings of every list kept in order of freq, then ASCII, so that 
+completions are ranked without visiting siblings. Freq of a sibling is the 
+most statements ending at any one node of it, the sibling or one below it. A 
+statement ending within a merged label is not told apart from those going on */
+typedef struct {
+    rank_t*         ranks;        /* siblings of all lists, list after list */
+    run_t*          runs;         /* siblings of list of each node */
+    uint32_t        version;      /* version of automaton ranked */
+} ranks_t;
+
+/* A list once a completion reaches it */
+typedef struct {
+    uint32_t        first;        /* first sibling of list among ranks */
+    int             count;        /* number of siblings */
+    int             above;        /* list of node above, or NO_LIST */
+    int             pos;          /* rank of node above in its list */
+    int             len;          /* characters of completion above list */
+    int             index;        /* characters of labels printed already */
+} reached_t;
+
+/* Completions yet to be found through a ranked sibling and those ranked after 
+it, none more frequent than sibling, or the one ending at sibling */
+typedef struct {
+    int             freq;         /* freq of sibling, or statements ending */
+    int             len;          /* characters of completion above sibling */
+    int             list;         /* list of sibling, or NO_LIST for prompt */
+    int             pos;          /* rank of sibling in list */
+    int             end;          /* whether completion ends at sibling */
+} branch_t;
+
+/* Completions of a prompt are found best first. Branch of highest freq is 
+taken, leaving its sibling ranked next, the completion ending at it and the 
+list below it as branches. As freq never grows going down, completions come in 
+order of statements ending at them. Branches are taken up to OUTPUT_MAX times 
+for each completion wanted, after that a branch left follows nodes of higher 
+freq, so work grows with number of completions rather than with nodes below 
+prompt */
+typedef struct {
+    reached_t*      lists;        /* lists reached so far */
+    int             num_lists;    /* number of lists reached */
+    int             max_lists;    /* number of lists allocated */
+    branch_t*       heap;         /* branches left, best one first */
+    int             num;          /* number of branches left */
+    int             max;          /* number of branches allocated */
+} ranking_t;
+
+/* Data structure to answer prompts concurrently **************************/
+/* Where a prompt has matched after one of its characters, in nodes, or in 
+cells once frozen */
+typedef struct {
+    ref_t           tail;         /* node or cell of latest matched character */
+    uint32_t        parent;       /* cell above list being matched if frozen */
+    int             str_len;      /* length of string being matched */
+    int             index;        /* index of next character to match */
+} cursor_t;
+
+/* Latest prompt with where it matched after each character, so that a prompt 
+sharing its first characters resumes matching where the two part */
+typedef struct {
+    char            chars[OUTPUT_MAX]; /* characters of latest prompt */
+    cursor_t        cursors[OUTPUT_MAX]; /* where each character matched */
+    int             len;          /* number of characters matched */
+} trail_t;
+
+/* Where a prompt has matched so far, each query keeps its own along with its 
+own caches of generated text and answers, so queries leave automaton 
+untouched */
+typedef struct {
+    ref_t           tail;         /* node of latest matched character */
+    int             str_len;      /* length of string being matched */
+    memo_t*         memo;         /* cache of generated text */
+    uint32_t        version;      /* version of automaton caches are valid 
+                                  for */
+    stats_t         stats;        /* work done answering prompts */
+    answers_t*      answers;      /* cache of lines printed for prompts */
+    trail_t*        trail;        /* where latest prompt matched, kept only 
+                                  answering sorted prompts */
+    int             top_k;        /* completions printed for a prompt in 
+                                  order of freq, 0 for greedy one only */
+    ranking_t*      ranking;      /* room to rank completions, NULL until 
+                                  ranked */
+} query_t;
+
+/* A prompt of a batch. Prompts are answered in order of their first 
+characters, so those sharing them are answered one after another */
+typedef struct {
+    uint64_t        key;          /* first KEY_CHARS characters, first one 
+                                  highest */
+    int             len;          /* number of characters up to OUTPUT_MAX */
+    int             num;          /* order of prompt in batch */
+} prompt_t;
+
+typedef struct {
+    char*           chars;        /* characters of all prompts */
+    size_t          num_chars;    /* number of characters in use */
+    size_t          max_chars;    /* number of characters allocated */
+    size_t*         starts;       /* offset of each prompt in chars */
+    int*            lens;         /* length of each prompt */
+    int             num;          /* number of prompts */
+    int             max;          /* number of prompts allocated */
+    int             end;          /* how last prompt ended */
+    prompt_t*       sorted;       /* prompts in order of first characters */
+    prompt_t*       spare;        /* room to sort prompts */
+    char*           lines;        /* lines printed for each prompt, 
+                                  line_size apart */
+    int*            line_lens;    /* length of lines of each prompt */
+    int             max_sorted;   /* number of prompts sorted allocated */
+    int             line_size;    /* bytes of lines of a prompt */
+} batch_t;
+
+/* Data structure to read input a block at a time *************************/
+typedef struct {
+    FILE*           fp;           /* input stream */
+    char*           buf;          /* input read but not yet consumed */
+    size_t          pos;          /* start of unconsumed input in buf */
+    size_t          end;          /* end of input in buf */
+    size_t          max;          /* size of buf */
+    int             eof;          /* whether input stream is exhausted */
+    int             previously_newline; /* whether last line had newline */
+    int             stage_num;    /* stage of input being read */
+} reader_t;
+
+/* Data structure to write output a block at a time ************************/
+/* Output lines are assembled in buf and written once it fills, directly to 
+fd with write(2) when fd is given, otherwise to fp through stdio */
+typedef struct {
+    int             fd;           /* output file descriptor, or NO_FD */
+    FILE*           fp;           /* output stream if fd is NO_FD */
+    char*           buf;          /* output not yet written */
+    size_t          num;          /* number of bytes in buf */
+    size_t          max;          /* size of buf */
+} writer_t;
+
 typedef struct {       
     list_t*         outputs;      /* a list of output nodes */
     total_t*        total;        /* state of automaton */         
+    memory_t*       memory;       /* node pools and string arena */
+    memo_t*         memo;         /* cache of generated text */
+    uint32_t        version;      /* number of times compressed */
+    path_t*         path;         /* path of latest statement inserted */
+    frozen_t*       frozen;       /* frozen layout once nodes are released */
+    stats_t         stats;        /* work done building and compressing */
+    radix_t*        radix;        /* freq of merged nodes, NULL if not kept */
+    ranks_t*        ranks;        /* siblings in order of freq, NULL until 
+                                  ranked */
 } automaton_t;  
 
+typedef struct {
+    automaton_t*    automaton;    /* automaton shared by all workers */
+    batch_t*        batch;        /* prompts shared by all workers */
+    int             first;        /* first sorted prompt of this worker */
+    int             last;         /* sorted prompt after last one of this 
+                                  worker */
+    query_t         query;        /* position of prompt being answered */
+    pthread_t       thread;       /* thread running this worker */
+} worker_t;
+
+/* Statements are sharded by their first character, which no other shard 
+shares, so each shard is built on its own and spliced below the root list */
+typedef struct {
+    batch_t*        batch;        /* statements shared by all shards */
+    char*           shard_of;     /* shard of each first character */
+    int             shard;        /* shard built by this builder */
+    automaton_t*    automaton;    /* automaton of this shard */
+    pthread_t       thread;       /* thread running this builder */
+} builder_t;
+
+/* Data structure to benchmark every stage *******************************/
+/* Shape of a synthetic input. Statements are 1 to max_len characters drawn 
+from the first alphabet printable characters after 'a', and share of them 
+extend part of an earlier one. Prompts are mostly starts of statements */
+typedef struct {
+    int             statements;   /* number of statements */
+    int             max_len;      /* max characters of a statement */
+    int             alphabet;     /* number of distinct characters */
+    int             share;        /* percent of statements sharing a prefix */
+    int             num_compress; /* number of compression */
+    int             prompts;      /* number of prompts of each stage */
+    uint64_t        seed;         /* seed of random numbers, same input for 
+                                  same seed */
+} corpus_t;
+
+typedef struct {
+    const char*     name;         /* name of phase */
+    double          seconds;      /* time taken by phase */
+    long            items;        /* number of items phase went through */
+} phase_t;
+
+/* Each phase is reported as a line of JSON if there is a stream, and kept 
+for the instrumentation report */
+typedef struct {
+    FILE*           fp;           /* stream to report to, or NULL */
+    int             on;           /* whether phases are timed at all */
+    struct timespec start;        /* time latest phase started */
+    phase_t         phases[PHASES_MAX]; /* phases timed so far */
+    int             num;          /* number of phases timed */
+} stopwatch_t;
+
+/* Shape of automaton, counts of lists by number of siblings and of leaves 
+by depth in states, from 1 up in powers of two */
+typedef struct {
+    uint64_t        fanout[ASCII_MAX + INT_ONE]; /* lists by fanout */
+    uint64_t        depth[DEPTH_BUCKETS]; /* leaves by depth bucket */
+} shape_t;
+
+typedef struct {
+    int             num_threads;  /* number of threads building automaton 
+                                  and answering prompts */
+    char*           load_path;    /* snapshot to answer prompts from */
+    char*           save_path;    /* snapshot of automaton as built */
+    char*           compressed_path; /* snapshot of compressed automaton */
+    char*           socket_path;  /* socket to serve prompts on */
+    int             num_compress; /* number of compression before serving */
+    int             radix;        /* whether to build automaton compressed */
+    int             freeze;       /* whether to freeze automaton once it is 
+                                  compressed */
+    int             timed;        /* whether to report time of each phase */
+    int             generate;     /* whether to generate a corpus instead */
+    corpus_t        corpus;       /* shape of corpus to generate */
+    char*           stats_path;   /* file to report instrumentation to */
+    char*           append_path;  /* statements to append once compressed */
+    int             top_k;        /* completions printed for a prompt in 
+                                  order of freq, 0 for greedy one only */
+    int             check;        /* whether to run built-in checks instead */
+} options_t;
+
+/* Data structure to check the program ***********************************/
+/* Statements to build automaton from and lines a prompt is to get */
+typedef struct {
+    const char*     statements;   /* statements, one a line */
+    const char*     prompt;       /* prompt to complete */
+    int             top_k;        /* completions asked, 0 for greedy one */
+    const char*     lines;        /* lines expected, one a line */
+} check_t;
+
+/* Data structure of a client connected to server *************************/
+/* Every message is a 4-byte big-endian length followed by that many bytes. 
+A request is an operation byte and its argument, a response is a status 
+byte, a 4-byte time taken in microseconds and its result. Requests may be 
+sent without waiting for responses, which come back in the same order */
+typedef struct {
+    int             fd;           /* connected socket, or NO_FD */
+    char*           buf;          /* requests received but not handled */
+    size_t          num;          /* number of bytes in buf */
+    size_t          max;          /* size of buf */
+    writer_t*       writer;       /* responses not yet sent */
+    int             waiting;      /* whether it waits for training */
+} client_t;
+
+/* A training request compresses automaton or appends statements, one a 
+line. Its client waits for it while other clients are answered meanwhile */
+typedef struct {
+    int             state;        /* JOB_NONE, JOB_QUEUED or JOB_DONE */
+    uint32_t        seq;          /* order of request among all clients */
+    char            op;           /* OP_COMPRESS or OP_APPEND */
+    char*           arg;          /* copy of argument of request */
+    uint32_t        len;          /* length of arg */
+    struct timespec start;        /* time request arrived */
+    int             status;       /* status of response */
+    char            out[FORMAT_MAX]; /* result of response */
+    int             out_len;      /* length of result */
+} job_t;
+
+/* A training request kept until no version that lacks it is left */
+typedef struct {
+    char            op;           /* OP_COMPRESS or OP_APPEND */
+    char*           arg;          /* copy of argument of request */
+    uint32_t        len;          /* length of arg */
+    uint32_t        batch;        /* batches carried out once it is */
+} logged_t;
+
+/* Versions of automaton are never changed once published. Server thread 
+answers prompts from the version it has pinned, writer thread trains a copy 
+of latest version and publishes it. Server thread pins latest version when 
+told and retires the one it let go of, so that answering never waits for 
+writer thread. Writer thread keeps the most recent version let go of as a 
+standby, and trains it next by first carrying out again the requests it 
+lacks, so that latest version is only copied whole when there is none */
+typedef struct {
+    automaton_t*    pinned;       /* version server thread answers from */
+    automaton_t*    published;    /* latest version */
+    automaton_t*    retired;      /* version let go of, yet to be kept */
+    uint32_t        batches;      /* batches carried out on latest version */
+    uint32_t        pinned_batches; /* batches carried out on pinned one */
+    uint32_t        retired_batches; /* batches carried out on retired one */
+    job_t           jobs[CLIENTS_MAX]; /* training request of each client */
+    uint32_t        next_seq;     /* order of next training request */
+    int             stopping;     /* whether writer thread is to stop */
+    pthread_mutex_t lock;         /* guards all of above */
+    pthread_cond_t  wake;         /* tells writer thread of new requests */
+    int             notify[INT_TWO]; /* pipe telling server thread of new 
+                                  versions */
+    pthread_t       thread;       /* writer thread */
+    automaton_t*    standby;      /* version to train next, writer's own */
+    uint32_t        standby_batches; /* batches carried out on standby */
+    logged_t*       log;          /* requests standby or pinned may lack */
+    uint32_t        num_log;      /* number of requests in log */
+    uint32_t        max_log;      /* size of log */
+} trainer_t;
+
 /* Function prototypes ********************************************************/
-node_t *get_new_node(void);
+node_t *get_new_node(automaton_t *automaton);
+node_t *get_node(automaton_t *automaton, ref_t ref);
+ref_t get_ref(automaton_t *automaton, node_t *node);
+char *get_str(automaton_t *automaton, node_t *node);
 list_t *get_new_list(void);
-state_t *get_new_state(void);
+path_t *get_new_path(void);
+void free_path(path_t *path);
+uint32_t follow_path(automaton_t *automaton, char *line, uint32_t len);
 total_t *get_new_totals(void);
-char *get_string(char *c);
-char *combine_str(char *p1, char *p2);
-int mygetchar(void); 
-int get_num_compress(void);
-int find_matching_char(automaton_t *automaton, node_t *curr, char c, int*index);
-int find_x_node_left(automaton_t *automaton, node_t *curr, int *highest_freq);
-int find_x_node_right(automaton_t *automaton, node_t *curr, int *highest_freq, 
-                    char *highest_ascii);
+memory_t *get_new_memory(void);
+void get_string(node_t *node, char c);
+void combine_str(automaton_t *automaton, node_t *p1, node_t *p2, int adopt);
+uint32_t get_new_str(automaton_t *automaton, size_t len);
+void free_str(automaton_t *automaton, node_t *node);
+int get_str_class(size_t len);
+void init_pool(pool_t *pool, size_t size);
+uint32_t pool_alloc(pool_t *pool);
+void pool_release(pool_t *pool, uint32_t ref);
+ref_t find_child(automaton_t *automaton, node_t *anchor, char key);
+ref_t find_successor(automaton_t *automaton, node_t *anchor, char key);
+int find_key(const char *keys, uint32_t count, char key);
+uint32_t find_above(const char *keys, uint32_t count, char key);
+int find_key_scalar(const char *keys, uint32_t count, char key);
+uint32_t find_above_scalar(const char *keys, uint32_t count, char key);
+#ifdef SIMD_LOOKUP
+int find_key_sse2(const char *keys, uint32_t count, char key);
+uint32_t find_above_sse2(const char *keys, uint32_t count, char key);
+#endif
+void add_child(automaton_t *automaton, node_t *anchor, char key, ref_t ref);
+void free_lookup(automaton_t *automaton, uint32_t lookup);
+ref_t *get_best(automaton_t *automaton, node_t *anchor);
+void update_best(automaton_t *automaton, node_t *anchor, node_t *node);
+char get_key(automaton_t *automaton, node_t *node);
+reader_t *get_new_reader(FILE *fp);
+int get_line(reader_t *reader, char **line, int *len);
+void fill_reader(reader_t *reader);
+void invalid_input(writer_t *writer);
+void free_reader(reader_t *reader);
+int get_num_compress(reader_t *reader, writer_t *writer);
+int find_matching_char(automaton_t *automaton, query_t *query, node_t *curr, 
+                       char c, int *index);
 automaton_t *get_new_automaton(void);
-automaton_t *construct_automaton(void);
+automaton_t *construct_automaton(reader_t *reader, writer_t *writer, 
+                                 int num_threads);
 automaton_t *add_root(automaton_t *automaton);  
-automaton_t *compress_automaton(automaton_t *automaton);
+automaton_t *compress_automaton(automaton_t *automaton, int num_compress);
+int count_merged(automaton_t *automaton, int num_compress);
 automaton_t *insert_vertically(automaton_t *automaton, char c);
 automaton_t *insert_horizontally(automaton_t *automaton, char c, 
                                 int *compare_root, int *invert_vertical);
-node_t *traverse_automaton(node_t *x_node, int direction, int *new);
-void process_stage_0(automaton_t *automaton);
-void process_prompt(automaton_t *automaton, int stage_num);
-void print_prefix(automaton_t *automaton, char c, int *char_count,
-                    int *first_input, int *terminate, int *index);
-void print_suffix(automaton_t *automaton, int *char_count, int *index);
-void print_stage_2_header(automaton_t *automaton);
+void process_stage_0(automaton_t *automaton, writer_t *writer);
+int process_prompt(automaton_t *automaton, reader_t *reader, 
+                   writer_t *writer, int stage_num, int num_threads, 
+                   int top_k);
+int process_batches(automaton_t *automaton, reader_t *reader, 
+                    writer_t *writer, int num_threads, int top_k);
+void answer_prompt(automaton_t *automaton, query_t *query, writer_t *writer, 
+                   const char *line, int len, int end);
+void walk_prompt(automaton_t *automaton, query_t *query, writer_t *writer, 
+                 const char *line, int len, int end);
+int match_prompt(automaton_t *automaton, query_t *query, writer_t *writer, 
+                 const char *line, int len, int *char_count, int *index);
+void answer_ranked(automaton_t *automaton, query_t *query, writer_t *writer, 
+                   const char *line, int len, int end, int k);
+int resume_prompt(query_t *query, writer_t *writer, const char *line, 
+                  int len);
+void keep_cursor(trail_t *trail, int i, char c, cursor_t cursor);
+automaton_t *build_automaton(const char *text, size_t len, int num_threads);
+automaton_t *construct_from_batch(batch_t *batch, int num_threads);
+query_t *get_new_query(automaton_t *automaton);
+int complete_prompt(automaton_t *automaton, query_t *query, 
+                    const char *prompt, int len, char *out);
+int complete_top_k(automaton_t *automaton, query_t *query, 
+                   const char *prompt, int len, int k, char *out);
+int check_prompt(automaton_t *automaton, query_t *query, const char *prompt, 
+                 int len);
+void free_query(query_t *query);
+reader_t *get_text_reader(const char *text, size_t len);
+void *run_worker(void *arg);
+int read_batch(reader_t *reader, batch_t *batch, int max_num);
+automaton_t *construct_in_shards(batch_t *batch, int num_shards);
+void *run_builder(void *arg);
+void get_shards(batch_t *batch, char *shard_of, int num_shards);
+void splice_shard(automaton_t *automaton, automaton_t *shard);
+uint32_t append_pool(pool_t *to, pool_t *from, char *released);
+void insert_statement(automaton_t *automaton, char *line, int len);
+void insert_sibling(automaton_t *automaton, node_t *anchor, node_t *new);
+automaton_t *construct_radix(reader_t *reader, writer_t *writer);
+void insert_radix(automaton_t *automaton, radix_t *radix, char *line, int len);
+ref_t new_leaf(automaton_t *automaton, radix_t *radix, const char *chars, 
+               int len);
+void add_branch(automaton_t *automaton, radix_t *radix, ref_t anchor, 
+                const char *prefix, int len, const char *rest, int rest_len);
+void split_chain(automaton_t *automaton, radix_t *radix, ref_t parent, 
+                 ref_t anchor, int len, const char *rest, int rest_len);
+void extend_leaf(automaton_t *automaton, radix_t *radix, ref_t anchor, 
+                 ref_t leaf, const char *rest, int rest_len);
+void set_label(automaton_t *automaton, node_t *node, const char *chars, 
+               uint32_t len);
+merged_t *get_chain(radix_t *radix, ref_t anchor);
+void set_chain(radix_t *radix, ref_t anchor, merged_t *chain);
+char *get_room(radix_t *radix, uint32_t len);
+radix_t *get_new_radix(void);
+void free_radix(radix_t *radix);
+void keep_merged(automaton_t *automaton, int keep);
+int append_statements(automaton_t *automaton, reader_t *reader, 
+                      writer_t *writer);
+int append_file(automaton_t *automaton, char *path, writer_t *writer);
+void join_chains(radix_t *radix, ref_t y, ref_t z, uint32_t above, 
+                 uint32_t below, merged_t merged);
+void clear_memo(memo_t *memo);
+void save_automaton(automaton_t *automaton, char *path);
+automaton_t *load_automaton(char *path);
+void thaw_memory(memory_t *memory);
+void check_snapshot(automaton_t *automaton, char *path);
+void load_merged(automaton_t *automaton, char *path, char *words);
+void thaw_array(char **array, size_t size);
+void snapshot_error(char *path, char *reason);
+automaton_t *serve_automaton(automaton_t *automaton, char *path);
+void accept_client(int listener, client_t *clients);
+int receive_requests(trainer_t *trainer, query_t *query, client_t *client, 
+                     job_t *job, int *running);
+int answer_requests(trainer_t *trainer, query_t *query, client_t *client, 
+                    job_t *job, int *running);
+void handle_request(trainer_t *trainer, query_t *query, client_t *client, 
+                    job_t *job, char *request, uint32_t len, int *running);
+int can_train(automaton_t *automaton, char op, char *arg, uint32_t len);
+void put_response(writer_t *writer, int status, struct timespec *start, 
+                  char *out, int out_len);
+trainer_t *start_trainer(automaton_t *automaton);
+void *run_trainer(void *arg);
+int get_queued(trainer_t *trainer, int *order);
+void train_copy(automaton_t *copy, job_t *job);
+automaton_t *get_standby(trainer_t *trainer, automaton_t *latest);
+void keep_standby(trainer_t *trainer, automaton_t *automaton, 
+                  uint32_t batches);
+void log_job(trainer_t *trainer, job_t *job, uint32_t batch);
+void prune_log(trainer_t *trainer, uint32_t batches);
+void finish_jobs(trainer_t *trainer, query_t *query, client_t *clients, 
+                 int *running);
+automaton_t *stop_trainer(trainer_t *trainer);
+automaton_t *clone_automaton(automaton_t *automaton);
+radix_t *clone_radix(automaton_t *automaton, radix_t *radix);
+void close_client(client_t *client);
+uint32_t get_length(char *header);
+void put_length(writer_t *writer, uint32_t len);
+batch_t *get_new_batch(void);
+void free_batch(batch_t *batch);
+void sort_batch(batch_t *batch);
+options_t get_options(int argc, char *argv[]);
+void print_usage(FILE *fp, char *name);
+void print_prefix(automaton_t *automaton, query_t *query, writer_t *writer, 
+                  char c, int *char_count, int *first_input, int *terminate, 
+                  int *index);
+void print_suffix(automaton_t *automaton, query_t *query, writer_t *writer, 
+                  int *char_count, int *index);
+void print_stage_2_header(automaton_t *automaton, writer_t *writer);
 void insert_equal_result(automaton_t *automaton, node_t *curr, node_t *new);
-void insert_unequal_result(automaton_t *automaton, int result, node_t *curr, 
-                        node_t *new, int *compare_root, int *insert_vertical);
-void insert_inbetween_left(node_t *new_node, node_t *curr_node);
-void insert_inbetween_right(node_t *new_node, node_t *curr_node);
+void insert_unequal_result(automaton_t *automaton, node_t *anchor, 
+                           node_t *new, int *insert_vertical);
+void insert_beside(automaton_t *automaton, node_t *new_node, 
+                   node_t *curr_node, int side);
 void delete_node(automaton_t *automaton, node_t *x_node);
-void check_visited(node_t *node, int *possible_visit);
+int can_compress(automaton_t *automaton, node_t *x_node);
+void push_children(automaton_t *automaton, worklist_t *worklist, 
+                   node_t *x_node);
+void push_node(worklist_t *worklist, ref_t ref);
 void free_automaton(automaton_t *automaton);
-void free_node(node_t *p1, int free_surround);
-void null_surrounding_nodes(node_t *p1);
-void print_char(node_t *node, int *char_count, int index);
-void print_ellipses(int *char_count);   
-static void recursive_free_left(automaton_t *automaton, node_t *root);
-static void recursive_free_right(automaton_t *automaton, node_t *root);
+void free_node(automaton_t *automaton, node_t *p1);
+void print_char(automaton_t *automaton, writer_t *writer, node_t *node, 
+                int *char_count, int index);
+void print_ellipses(writer_t *writer, int *char_count);   
+writer_t *get_new_writer(int fd, FILE *fp);
+void put_char(writer_t *writer, char c);
+void put_chars(writer_t *writer, const char *chars, size_t len);
+void put_format(writer_t *writer, const char *format, ...);
+void flush_writer(writer_t *writer);
+void free_writer(writer_t *writer);
+memo_t *get_new_memo(void);
+void free_memo(memo_t *memo);
+answers_t *get_new_answers(void);
+void clear_answers(answers_t *answers);
+void free_answers(answers_t *answers);
+answer_t *get_answer(answers_t *answers, const char *prompt, int len);
+trail_t *get_new_trail(void);
+completion_t *get_completion(automaton_t *automaton, memo_t *memo, 
+                             ref_t ref);
+ranking_t *get_new_ranking(void);
+void free_ranking(ranking_t *ranking);
+void rank_automaton(automaton_t *automaton);
+void free_ranks(ranks_t *ranks);
+int rank_completions(automaton_t *automaton, query_t *query, int index, 
+                     int room, int k, char *texts, int *lens);
+void rank_list(automaton_t *automaton, ranking_t *ranking, ref_t node, 
+               int above, int pos, int len, int index);
+int copy_ranked(automaton_t *automaton, ranking_t *ranking, branch_t *branch, 
+                int room, char *text);
+void push_branch(ranking_t *ranking, branch_t branch);
+branch_t pop_branch(ranking_t *ranking);
+int is_better(branch_t *a, branch_t *b);
+void freeze_automaton(automaton_t *automaton);
+void release_nodes(memory_t *memory);
+void free_frozen(frozen_t *frozen);
+void answer_frozen(automaton_t *automaton, query_t *query, writer_t *writer, 
+                   const char *line, int len, int end);
+int match_frozen(frozen_t *frozen, uint32_t parent, uint32_t *node, char c, 
+                 int index);
+int copy_label(frozen_t *frozen, uint32_t parent, uint32_t node, int index, 
+               char *text, int max);
+void forget_completion(automaton_t *automaton, ref_t node);
+completion_t *get_memo_set(memo_t *memo, ref_t node);
+void add_line(batch_t *batch, const char *line, int len);
+corpus_t get_corpus(char *spec);
+void generate_corpus(corpus_t *corpus, writer_t *writer);
+void generate_prompts(corpus_t *corpus, batch_t *statements, char *line, 
+                      uint64_t *state, writer_t *writer);
+uint32_t get_random(uint64_t *state, uint32_t range);
+char get_random_char(corpus_t *corpus, uint64_t *state);
+void time_lookups(automaton_t *automaton, stopwatch_t *watch);
+int run_checks(void);
+int run_check(const check_t *check);
+int check_lookups(void);
+void start_phase(stopwatch_t *watch);
+void end_phase(stopwatch_t *watch, const char *phase, long items, 
+               const char *unit);
+long get_peak_rss(void);
+void add_stats(stats_t *to, stats_t *from);
+void get_shape(automaton_t *automaton, shape_t *shape);
+void add_depth(shape_t *shape, uint32_t depth);
+void report_stats(char *path, stats_t *stats, shape_t *shape, 
+                  stopwatch_t *watch);
 
 /* Main program controls all the action ***************************************/
+#ifndef AUTOMATON_LIBRARY
 int main(int argc, char *argv[]) {
-    automaton_t *automaton = construct_automaton();
-    process_stage_0(automaton);
-    process_prompt(automaton, STAGE_1);
-    automaton = compress_automaton(automaton);
-    print_stage_2_header(automaton); 
-    process_prompt(automaton, STAGE_2);
-    printf(THEEND);
+    options_t options = get_options(argc, argv);
+    writer_t *writer = get_new_writer(fileno(stdout), stdout);
+    if (options.generate) {
+        generate_corpus(&options.corpus, writer);
+        free_writer(writer);
+        return EXIT_SUCCESS;
+    }
+    if (options.check) {
+        free_writer(writer);
+        return run_checks() ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    reader_t *reader = get_new_reader(stdin);
+    stopwatch_t watch = {options.timed ? stderr : NULL, 
+                         options.timed || options.stats_path != NULL, 
+                         {INT_ZER, INT_ZER}, {{NULL, INT_ZER, INT_ZER}}, 
+                         INT_ZER};
+    shape_t shape;
+    automaton_t *automaton;
+    start_phase(&watch);
+    if (options.load_path) {
+        /* Input starts from stage 1 prompts */
+        automaton = load_automaton(options.load_path);
+        reader->stage_num = STAGE_1;
+        reader->previously_newline = TRUE;
+    } else if (options.radix) {
+        automaton = construct_radix(reader, writer);
+    } else {
+        automaton = construct_automaton(reader, writer, options.num_threads);
+    }
+    end_phase(&watch, options.load_path ? "load" : "construct", 
+              automaton->total->character, "characters");
+    if (options.timed) time_lookups(automaton, &watch);
+    /* Freq of merged nodes is kept to append statements, now, to a snapshot 
+    later or while serving. A loaded snapshot keeps it if saved with it. It is 
+    dropped only once compressed, to count out as many merged nodes as asked */
+    int keep = options.append_path || options.save_path || 
+               options.compressed_path || 
+               (options.socket_path && !options.freeze);
+    if (keep && !options.load_path) keep_merged(automaton, keep);
+    if (options.append_path && !automaton->radix) {
+        snapshot_error(options.load_path, "no freq of merged nodes kept to "
+                       "append statements to");
+    }
+    if (options.save_path) save_automaton(automaton, options.save_path);
+    if (options.socket_path) {
+        automaton = compress_automaton(automaton, options.num_compress);
+        if (!keep) keep_merged(automaton, keep);
+        if (options.append_path) {
+            append_file(automaton, options.append_path, writer);
+        }
+        if (options.compressed_path) {
+            save_automaton(automaton, options.compressed_path);
+        }
+        if (options.freeze) freeze_automaton(automaton);
+        automaton = serve_automaton(automaton, options.socket_path);
+        if (options.stats_path) {
+            get_shape(automaton, &shape);
+            report_stats(options.stats_path, &automaton->stats, &shape, 
+                         &watch);
+        }
+        free_automaton(automaton);
+        free_reader(reader);
+        free_writer(writer);
+        return EXIT_SUCCESS;
+    }
+    process_stage_0(automaton, writer);
+    start_phase(&watch);
+    int num = process_prompt(automaton, reader, writer, STAGE_1, 
+                             options.num_threads, options.top_k);
+    end_phase(&watch, "stage_1", num, "prompts");
+    int num_compress = get_num_compress(reader, writer);
+    int state = automaton->total->state;
+    start_phase(&watch);
+    automaton = compress_automaton(automaton, num_compress);
+    end_phase(&watch, "compress", state - automaton->total->state, "states");
+    if (!keep) keep_merged(automaton, keep);
+    if (options.append_path) {
+        start_phase(&watch);
+        num = append_file(automaton, options.append_path, writer);
+        end_phase(&watch, "append", num, "statements");
+    }
+    if (options.compressed_path) {
+        save_automaton(automaton, options.compressed_path);
+    }
+    if (options.freeze) {
+        start_phase(&watch);
+        freeze_automaton(automaton);
+        end_phase(&watch, "freeze", automaton->frozen->num, "cells");
+    }
+    print_stage_2_header(automaton, writer); 
+    start_phase(&watch);
+    num = process_prompt(automaton, reader, writer, STAGE_2, 
+                         options.num_threads, options.top_k);
+    end_phase(&watch, "stage_2", num, "prompts");
+    put_format(writer, THEEND);
+    stats_t stats = automaton->stats;
+    if (options.stats_path) get_shape(automaton, &shape);
+    state = automaton->total->state;
+    start_phase(&watch);
     free_automaton(automaton);
+    end_phase(&watch, "free", state, "states");
+    if (options.stats_path) {
+        report_stats(options.stats_path, &stats, &shape, &watch);
+    }
+    free_reader(reader);
+    free_writer(writer);
     return EXIT_SUCCESS; 
 }
 
-/* Functions that trigger each stages *****************************************/
-/* Read input from STDIN, skip carriage return */
-int mygetchar() {
-    int c;
-    static int previously_newline = FALSE, stage_num = 0;
-    while ((c = getchar()) == CRTRNC) {  
+/* Read command line options, printing usage on -h or any unknown one */
+options_t get_options(int argc, char *argv[]) {
+    options_t options = {INT_ONE, NULL, NULL, NULL, NULL, INT_ZER, FALSE, 
+                         FALSE, FALSE, FALSE, get_corpus(""), NULL, NULL, 
+                         INT_ZER, FALSE};
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-j") && i + INT_ONE < argc) {
+            options.num_threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-l") && i + INT_ONE < argc) {
+            options.load_path = argv[++i];
+        } else if (!strcmp(argv[i], "-s") && i + INT_ONE < argc) {
+            options.save_path = argv[++i];
+        } else if (!strcmp(argv[i], "-S") && i + INT_ONE < argc) {
+            options.compressed_path = argv[++i];
+        } else if (!strcmp(argv[i], "-u") && i + INT_ONE < argc) {
+            options.socket_path = argv[++i];
+        } else if (!strcmp(argv[i], "-k") && i + INT_ONE < argc) {
+            options.num_compress = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-r")) {
+            options.radix = TRUE;
+        } else if (!strcmp(argv[i], "-f")) {
+            options.freeze = TRUE;
+        } else if (!strcmp(argv[i], "-t")) {
+            options.timed = TRUE;
+        } else if (!strcmp(argv[i], "-a") && i + INT_ONE < argc) {
+            options.append_path = argv[++i];
+        } else if (!strcmp(argv[i], "-i") && i + INT_ONE < argc) {
+            options.stats_path = argv[++i];
+        } else if (!strcmp(argv[i], "-n") && i + INT_ONE < argc) {
+            options.top_k = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-g") && i + INT_ONE < argc) {
+            options.generate = TRUE;
+            options.corpus = get_corpus(argv[++i]);
+        } else if (!strcmp(argv[i], "-c")) {
+            options.check = TRUE;
+        } else if (!strcmp(argv[i], "-h")) {
+            print_usage(stdout, argv[0]);
+            exit(EXIT_SUCCESS);
+        } else {
+            print_usage(stderr, argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (options.num_threads <= 0) {
+        options.num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (options.num_threads < INT_ONE) options.num_threads = INT_ONE;
+    if (options.num_threads > THREADS_MAX) options.num_threads = THREADS_MAX;
+    if (options.top_k < INT_ZER) options.top_k = INT_ZER;
+    if (options.top_k > TOP_MAX) options.top_k = TOP_MAX;
+    /* Cells keep no freq to rank completions by */
+    if (options.top_k && options.freeze) {
+        fprintf(stderr, "Options -n and -f cannot be combined, program "
+                "terminated\n");
+        exit(EXIT_FAILURE);
+    }
+    return options;
+}
+
+/* Print usage and what each option does */
+void print_usage(FILE *fp, char *name) {
+    fprintf(fp, "Usage: %s [-j threads] [-r] [-f] [-t] [-i report] "
+            "[-a statements]\n"
+            "       [-n completions] [-l snapshot] [-s snapshot] "
+            "[-S snapshot]\n"
+            "       [-u socket [-k number]]\n"
+            "       %s -g statements,max_len,alphabet,share,compression,"
+            "prompts,seed\n"
+            "       %s -c | -h\n", name, name, name);
+    fputs("Statements of stage 0 build an automaton that answers prompts "
+          "of stage 1, is\n"
+          "compressed as many times as stage 2 asks and answers its "
+          "prompts.\n"
+          "  -j threads     build and answer prompts on threads, 0 for one "
+          "per processor;\n"
+          "                 prompts are answered a sorted batch at a time\n"
+          "  -r             build with unary chains already compressed\n"
+          "  -f             freeze into a compact read-only layout once "
+          "compressed\n"
+          "  -t             report time, throughput and peak RSS of each "
+          "stage, and of\n"
+          "                 scalar and SSE2 search of small lookups, to "
+          "stderr as JSON\n"
+          "  -i report      report counters, phases and shape of automaton "
+          "as JSON to a\n"
+          "                 file or - for stderr, counters need "
+          "-DAUTOMATON_STATS\n"
+          "  -a statements  append statements of a file once compressed, "
+          "costing time of\n"
+          "                 those statements only\n"
+          "  -n completions answer each prompt with up to this many "
+          "completions, a line\n"
+          "                 each, in order of statements ending below "
+          "them; -n 1 can\n"
+          "                 differ from the default completion, which "
+          "follows the sibling\n"
+          "                 most statements go past, then the highest "
+          "ASCII one\n"
+          "  -l snapshot    load automaton in place of stage 0\n"
+          "  -s snapshot    save automaton as built, -S once compressed\n"
+          "  -u socket      serve prompts on a Unix domain socket until "
+          "told to quit,\n"
+          "                 after -k compressions; compression and "
+          "appending asked\n"
+          "                 meanwhile are carried out on another thread\n"
+          "  -g spec        print a synthetic input of a given shape "
+          "instead, to time e.g.\n"
+          "                 -g 100000,40,26,50,1000,100000,1 | ./automaton "
+          "-t\n"
+          "  -c             run built-in checks instead\n"
+          "  -h             print this help\n", fp);
+}
+#endif
+
+/* Functions that trigger each stages *****************************************/
+/* Build automaton using input statements in stage 0 */
+automaton_t *construct_automaton(reader_t *reader, writer_t *writer, 
+                                 int num_threads) {
+    /* Read all statements first to build shards concurrently */
+    if (num_threads > INT_ONE) {
+        batch_t *batch = get_new_batch();
+        /* Input must not end within stage 0 */
+        if (read_batch(reader, batch, INT32_MAX) != STAGE_END) {
+            invalid_input(writer);
+        }
+        automaton_t *automaton = construct_from_batch(batch, num_threads);
+        free_batch(batch);
+        return automaton;
+    }
+    automaton_t *automaton = get_new_automaton();  
+    int end, len;
+    char *line;
+    while ((end = get_line(reader, &line, &len)) != STAGE_END) {
+        /* Input must not end within stage 0 */
+        if (end != STMNT_END) invalid_input(writer);
+        insert_statement(automaton, line, len);
+    } 
+    return automaton;
+}
+
+/* Build automaton from statements read in a batch */
+automaton_t *construct_from_batch(batch_t *batch, int num_threads) {
+    if (num_threads > INT_ONE) return construct_in_shards(batch, num_threads);
+    automaton_t *automaton = get_new_automaton();
+    for (int i = 0; i < batch->num; i++) {
+        insert_statement(automaton, batch->chars + batch->starts[i], 
+                         batch->lens[i]);
+    }
+    return automaton;
+}
+
+/* Insert a statement into automaton one character at a time */
+void insert_statement(automaton_t *automaton, char *line, int len) {
+    int insert_vertical = !automaton->outputs->head, compare_root = TRUE;
+    path_t *path = automaton->path;
+    if (path->max < (uint32_t)len) {
+        while (path->max < (uint32_t)len) path->max *= INT_TWO;
+        path->chars = (char *)realloc(path->chars, path->max);
+        path->nodes = (ref_t *)realloc(path->nodes, path->max * sizeof(ref_t));
+        path->anchors = (ref_t *)realloc(path->anchors, 
+                                         path->max * sizeof(ref_t));
+        assert(path->chars && path->nodes && path->anchors);
+    }
+    /* Skip characters shared with latest statement */
+    uint32_t i = follow_path(automaton, line, len);
+    if (i) compare_root = FALSE;
+    for (; i < (uint32_t)len; i++) {
+        /* Insert new nodes vertically if its string is not in automaton */
+        if (insert_vertical) {
+            insert_vertically(automaton, line[i]);
+        } else {
+            /* Insert horizonally if the same transition string is found */
+            insert_horizontally(automaton, line[i], &compare_root, 
+                                &insert_vertical);
+        }   
+        automaton->total->character++;  
+        path->chars[i] = line[i];
+        path->nodes[i] = automaton->outputs->tail;
+        path->anchors[i] = automaton->outputs->anchor;
+    }
+    path->len = len;
+    if (len) get_node(automaton, automaton->outputs->tail)->ends++;
+    automaton->total->statement++; 
+    automaton->total->freq++;          
+}
+
+/* Walk down nodes of first characters a statement shares with latest one, 
+counting each node passed as inserting them one by one would. Returns number 
+of characters shared */
+uint32_t follow_path(automaton_t *automaton, char *line, uint32_t len) {
+    path_t *path = automaton->path;
+    uint32_t same = INT_ZER;
+    while (same < len && same < path->len && line[same] == path->chars[same]) {
+        same++;
+    }
+    if (!same) return INT_ZER;
+    for (uint32_t i = 0; i + INT_ONE < same; i++) {
+        node_t *node = get_node(automaton, path->nodes[i]);
+        node->freq++;
+        update_best(automaton, get_node(automaton, path->anchors[i]), node);
+    }
+    automaton->total->freq += same - INT_ONE;
+    automaton->total->character += same;
+    automaton->outputs->tail = path->nodes[same - INT_ONE];
+    automaton->outputs->anchor = path->anchors[same - INT_ONE];
+    return same;
+}
+
+/* Print all information in stage 0 */
+void process_stage_0(automaton_t *automaton, writer_t *writer) {
+    assert(automaton);  
+    put_format(writer, SDELIM, INT_ZER);
+    put_format(writer, NOSFMT, automaton->total->statement);
+    put_format(writer, NOCFMT, automaton->total->character);
+    put_format(writer, NPSFMT, automaton->total->state);
+}
+
+/* Calling functions to print output strings in stages 1 and 2, top_k 
+completions of each prompt unless 0. Returns number of prompts answered */
+int process_prompt(automaton_t *automaton, reader_t *reader, 
+                   writer_t *writer, int stage_num, int num_threads, 
+                   int top_k) {
+    assert(automaton);  
+    if (stage_num == STAGE_1) put_format(writer, SDELIM, STAGE_1);
+    if (top_k) rank_automaton(automaton);
+    if (num_threads > INT_ONE) {
+        return process_batches(automaton, reader, writer, num_threads, top_k);
+    }
+    
+    int end, len, num = 0;
+    char *line;
+    query_t query = {NIL, INT_ZER, automaton->memo, automaton->version, 
+                     {{INT_ZER}}, get_new_answers(), NULL, top_k, NULL};
+    while ((end = get_line(reader, &line, &len)) != STAGE_END) { 
+        answer_prompt(automaton, &query, writer, line, len, end);
+        /* Input ending with a newline leaves an empty last line */
+        if (len || end != EOF) num++;
+        if (end == BAD_END) invalid_input(writer);
+        if (end == EOF) break;
+    }
+    add_stats(&automaton->stats, &query.stats);
+    free_answers(query.answers);
+    free_ranking(query.ranking);
+    return num;
+}
+
+/* Print a prompt followed by text generated from it, copied out of the 
+line cached for the same prompt if there is one */
+void answer_prompt(automaton_t *automaton, query_t *query, writer_t *writer, 
+                   const char *line, int len, int end) {
+    /* Characters past the limit are neither printed nor matched */
+    if (len > OUTPUT_MAX) len = OUTPUT_MAX;
+    if (query->top_k) {
+        answer_ranked(automaton, query, writer, line, len, end, query->top_k);
+        return;
+    }
+    answer_t *answer = (len && end != BAD_END) ? 
+                       get_answer(query->answers, line, len) : NULL;
+    if (!answer) {
+        walk_prompt(automaton, query, writer, line, len, end);
+        return;
+    }
+    if (answer->len) {
+        COUNT(&query->stats, CNT_HITS, INT_ONE);
+    } else {
+        writer_t out = {NO_FD, NULL, answer->line, INT_ZER, OUTPUT_LINE};
+        walk_prompt(automaton, query, &out, line, len, end);
+        answer->len = out.num;
+    }
+    put_chars(writer, answer->line, answer->len);
+}
+
+/* Print a prompt followed by text generated from it, matching it from where 
+latest prompt parted from it */
+void walk_prompt(automaton_t *automaton, query_t *query, writer_t *writer, 
+                 const char *line, int len, int end) {
+    if (automaton->frozen) {
+        answer_frozen(automaton, query, writer, line, len, end);
+        return;
+    }
+    int char_count, index;
+    int terminate = match_prompt(automaton, query, writer, line, len, 
+                                 &char_count, &index);
+    /* Add suffix as provided in automaton to a given input prompt, unless 
+    input ends right after a newline character or is invalid */
+    if (!terminate && len && end != BAD_END) {
+        print_suffix(automaton, query, writer, &char_count, &index);
+    }
+}
+
+/* Print input prompt (prefix) up to the character limit, matching it from 
+where latest prompt parted from it. Returns whether matching terminated, 
+along with characters printed and index in string of node matched last */
+int match_prompt(automaton_t *automaton, query_t *query, writer_t *writer, 
+                 const char *line, int len, int *char_count, int *index) {
+    *char_count = resume_prompt(query, writer, line, len);
+    *index = 0;
+    int first_input = !*char_count, terminate = FALSE;
+    if (*char_count) {
+        cursor_t *cursor = &query->trail->cursors[*char_count - INT_ONE];
+        query->tail = cursor->tail;
+        query->str_len = cursor->str_len;
+        *index = cursor->index;
+    }
+    for (int i = *char_count; i < len && !terminate && 
+         *char_count < OUTPUT_MAX; i++) {
+        print_prefix(automaton, query, writer, line[i], char_count, 
+                     &first_input, &terminate, index);
+        if (query->trail && !terminate) {
+            keep_cursor(query->trail, i, line[i], (cursor_t){query->tail, 
+                        INT_ZER, query->str_len, *index});
+        }
+    }
+    return terminate;
+}
+
+/* Print up to k completions of a prompt in order of freq, each on a line of 
+its own after the prompt. A frozen automaton keeps no freq, so it prints the 
+greedy completion only */
+void answer_ranked(automaton_t *automaton, query_t *query, writer_t *writer, 
+                   const char *line, int len, int end, int k) {
+    if (automaton->frozen) {
+        answer_frozen(automaton, query, writer, line, len, end);
+        return;
+    }
+    char prefix[OUTPUT_LINE], texts[TOP_MAX * OUTPUT_MAX];
+    int lens[TOP_MAX], char_count, index;
+    writer_t out = {NO_FD, NULL, prefix, INT_ZER, OUTPUT_LINE};
+    int terminate = match_prompt(automaton, query, &out, line, len, 
+                                 &char_count, &index);
+    if (terminate || !len || end == BAD_END) {
+        put_chars(writer, prefix, out.num);
+        return;
+    }
+    print_ellipses(&out, &char_count);
+    int num = rank_completions(automaton, query, index, 
+                               OUTPUT_MAX - char_count, k, texts, lens);
+    for (int i = 0; i < num; i++) {
+        put_chars(writer, prefix, out.num);
+        put_chars(writer, texts + i * OUTPUT_MAX, lens[i]);
+        put_char(writer, NEWLIN);
+    }
+}
+
+/* Print characters latest prompt shares with a prompt and had matched, 
+which are matched the same. Returns number of those characters, none unless 
+query keeps a trail */
+int resume_prompt(query_t *query, writer_t *writer, const char *line, 
+                  int len) {
+    trail_t *trail = query->trail;
+    if (!trail) return INT_ZER;
+    int same = 0;
+    while (same < trail->len && same < len && 
+           trail->chars[same] == line[same]) {
+        same++;
+    }
+    trail->len = same;
+    put_chars(writer, line, same);
+    COUNT(&query->stats, CNT_RESUMED, same);
+    return same;
+}
+
+/* Keep where character i of a prompt matched */
+void keep_cursor(trail_t *trail, int i, char c, cursor_t cursor) {
+    trail->chars[i] = c;
+    trail->cursors[i] = cursor;
+    trail->len = i + INT_ONE;
+}
+
+/* Print all information in stage 2 */
+void print_stage_2_header(automaton_t *automaton, writer_t *writer) {
+    assert(automaton);
+    put_format(writer, SDELIM, STAGE_2);
+    put_format(writer, NPSFMT, automaton->total->state);
+    put_format(writer, TFQFMT, automaton->total->freq);
+    put_format(writer, MDELIM);
+}
+
+/* Library functions *********************************************************/
+/* Build automaton from text of statements, one per line, up to the first 
+empty line. Returns NULL if text has a character out of ASCII range */
+automaton_t *build_automaton(const char *text, size_t len, int num_threads) {
+    reader_t *reader = get_text_reader(text, len);
+    batch_t *batch = get_new_batch();
+    int end = read_batch(reader, batch, INT32_MAX);
+    free_reader(reader);
+    if (end == BAD_END) {
+        free_batch(batch);
+        return NULL;
+    }
+    /* Text ending with a newline leaves an empty last line */
+    if (end == EOF && !batch->lens[batch->num - INT_ONE]) batch->num--;
+    automaton_t *automaton = construct_from_batch(batch, num_threads);
+    free_batch(batch);
+    return automaton;
+}
+
+/* Create new query of automaton. Each thread needs its own query, while an 
+automaton can be shared by queries as long as it is not changed meanwhile */
+query_t *get_new_query(automaton_t *automaton) {
+    query_t *new = (query_t *)malloc(sizeof(*new));
+    assert(new);
+    new->tail = NIL;
+    new->str_len = INT_ZER;
+    new->memo = get_new_memo();
+    new->version = automaton->version;
+    memset(&new->stats, 0, sizeof(new->stats));
+    new->answers = get_new_answers();
+    new->trail = NULL;
+    new->top_k = INT_ZER;
+    new->ranking = NULL;
+    return new;
+}
+
+/* Complete a prompt into out, which has room for OUTPUT_LINE characters, 
+as the line stage 1 or 2 would print without its newline. Returns length of 
+line, or BAD_PROMPT if prompt has a character out of ASCII range */
+int complete_prompt(automaton_t *automaton, query_t *query, 
+                    const char *prompt, int len, char *out) {
+    if (check_prompt(automaton, query, prompt, len)) return BAD_PROMPT;
+    writer_t writer = {NO_FD, NULL, out, INT_ZER, OUTPUT_LINE};
+    answer_prompt(automaton, query, &writer, prompt, len, STMNT_END);
+    if (writer.num) writer.num--;
+    out[writer.num] = NUL_CH;
+    return writer.num;
+}
+
+/* Complete a prompt into its k most frequent completions, k up to TOP_MAX. 
+Line i goes to out + i * OUTPUT_LINE, which has room for k of them, as 
+complete_prompt would. Returns number of lines, none for an empty prompt, or 
+BAD_PROMPT if prompt has a character out of ASCII range. First call after 
+automaton is built or changed ranks it, unless rank_automaton did, which must 
+be done before queries share automaton */
+int complete_top_k(automaton_t *automaton, query_t *query, 
+                   const char *prompt, int len, int k, char *out) {
+    if (check_prompt(automaton, query, prompt, len)) return BAD_PROMPT;
+    rank_automaton(automaton);
+    if (k > TOP_MAX) k = TOP_MAX;
+    if (k < INT_ONE) return INT_ZER;
+    if (len > OUTPUT_MAX) len = OUTPUT_MAX;
+    char lines[TOP_MAX * OUTPUT_LINE];
+    writer_t writer = {NO_FD, NULL, lines, INT_ZER, sizeof(lines)};
+    answer_ranked(automaton, query, &writer, prompt, len, STMNT_END, k);
+    /* Each line printed ends with a newline */
+    int num = 0;
+    for (size_t start = 0, i = 0; i < writer.num; i++) {
+        if (lines[i] != NEWLIN) continue;
+        memcpy(out + num * OUTPUT_LINE, lines + start, i - start);
+        out[num * OUTPUT_LINE + i - start] = NUL_CH;
+        num++;
+        start = i + INT_ONE;
+    }
+    return num;
+}
+
+/* Check a prompt is in ASCII range, returning BAD_PROMPT if not, and drop 
+text query cached before automaton was changed, which no longer holds */
+int check_prompt(automaton_t *automaton, query_t *query, const char *prompt, 
+                 int len) {
+    for (int i = 0; i < len; i++) {
+        if ((unsigned char)prompt[i] >= ASCII_MAX) return BAD_PROMPT;
+    }
+    if (query->version != automaton->version) {
+        clear_memo(query->memo);
+        clear_answers(query->answers);
+        query->version = automaton->version;
+    }
+    return INT_ZER;
+}
+
+/* Free query */
+void free_query(query_t *query) {
+    free_memo(query->memo);
+    free_answers(query->answers);
+    free_ranking(query->ranking);
+    free(query);
+}
+
+/* Concurrent prompt functions ***********************************************/
+/* Answer prompts a batch at a time. Prompts of a batch are sorted and each 
+worker answers a contiguous run of them into their lines, then lines are 
+written out in order of prompts. Returns number of prompts answered */
+int process_batches(automaton_t *automaton, reader_t *reader, 
+                    writer_t *writer, int num_threads, int top_k) {
+    worker_t workers[THREADS_MAX];
+    batch_t *batch = get_new_batch();
+    if (top_k) batch->line_size = top_k * OUTPUT_LINE;
+    int num = 0;
+    for (int i = 0; i < num_threads; i++) {
+        workers[i].automaton = automaton;
+        workers[i].batch = batch;
+        workers[i].query = (query_t){NIL, INT_ZER, get_new_memo(), 
+                                     automaton->version, {{INT_ZER}}, 
+                                     get_new_answers(), get_new_trail(), 
+                                     top_k, NULL};
+    }
+    int end;
+    do {
+        end = read_batch(reader, batch, BATCH_MAX);
+        num += batch->num;
+        /* Input ending with a newline leaves an empty last line */
+        if (end == EOF && !batch->lens[batch->num - INT_ONE]) num--;
+        sort_batch(batch);
+        for (int i = 0; i < num_threads; i++) {
+            workers[i].first = (long)batch->num * i / num_threads;
+            workers[i].last = (long)batch->num * (i + INT_ONE) / num_threads;
+        }
+        /* Calling thread takes first run itself */
+        for (int i = 1; i < num_threads; i++) {
+            if (workers[i].first == workers[i].last) continue;
+            int failed = pthread_create(&workers[i].thread, NULL, run_worker, 
+                                        &workers[i]);
+            assert(!failed);
+        }
+        run_worker(&workers[INT_ZER]);
+        for (int i = 1; i < num_threads; i++) {
+            if (workers[i].first != workers[i].last) {
+                pthread_join(workers[i].thread, NULL);
+            }
+        }
+        for (int i = 0; i < batch->num; i++) {
+            put_chars(writer, batch->lines + (size_t)i * batch->line_size, 
+                      batch->line_lens[i]);
+        }
+    } while (end == STMNT_END);
+
+    for (int i = 0; i < num_threads; i++) {
+        add_stats(&automaton->stats, &workers[i].query.stats);
+        free_memo(workers[i].query.memo);
+        free_answers(workers[i].query.answers);
+        free(workers[i].query.trail);
+        free_ranking(workers[i].query.ranking);
+    }
+    free_batch(batch);
+    if (end == BAD_END) invalid_input(writer);
+    return num;
+}
+
+/* Answer a worker's run of sorted prompts, each into its own line */
+void *run_worker(void *arg) {
+    worker_t *worker = (worker_t *)arg;
+    batch_t *batch = worker->batch;
+    for (int i = worker->first; i < worker->last; i++) {
+        prompt_t *prompt = &batch->sorted[i];
+        int end = (prompt->num == batch->num - INT_ONE) ? batch->end : 
+                  STMNT_END;
+        writer_t out = {NO_FD, NULL, 
+                        batch->lines + (size_t)prompt->num * batch->line_size, 
+                        INT_ZER, batch->line_size};
+        answer_prompt(worker->automaton, &worker->query, &out, 
+                      batch->chars + batch->starts[prompt->num], prompt->len, 
+                      end);
+        batch->line_lens[prompt->num] = out.num;
+    }
+    return NULL;
+}
+
+/* Read up to max_num lines of a stage. Returns STMNT_END if more lines may 
+follow, otherwise how the stage ended */
+int read_batch(reader_t *reader, batch_t *batch, int max_num) {
+    int end = STMNT_END, len;
+    char *line;
+    batch->num = INT_ZER;
+    batch->num_chars = INT_ZER;
+    batch->end = STMNT_END;
+    while (batch->num < max_num && 
+           (end = get_line(reader, &line, &len)) != STAGE_END) {
+        add_line(batch, line, len);
+        /* Last prompt of stage, or of valid input */
+        if (end != STMNT_END) {
+            batch->end = end;
+            break;
+        }
+    }
+    return end;
+}
+
+/* Add a copy of a line to the end of a batch */
+void add_line(batch_t *batch, const char *line, int len) {
+    if (batch->num == batch->max) {
+        batch->max *= INT_TWO;
+        batch->starts = (size_t *)realloc(batch->starts, 
+                                          batch->max * sizeof(size_t));
+        batch->lens = (int *)realloc(batch->lens, batch->max * sizeof(int));
+        assert(batch->starts && batch->lens);
+    }
+    while (batch->num_chars + len > batch->max_chars) {
+        batch->max_chars *= INT_TWO;
+        batch->chars = (char *)realloc(batch->chars, batch->max_chars);
+        assert(batch->chars);
+    }
+    memcpy(batch->chars + batch->num_chars, line, len);
+    batch->starts[batch->num] = batch->num_chars;
+    batch->lens[batch->num++] = len;
+    batch->num_chars += len;
+}
+
+/* Create new batch of lines */
+batch_t *get_new_batch(void) {
+    batch_t *new = (batch_t *)malloc(sizeof(*new));
+    assert(new);
+    new->max_chars = READ_BLOCK;
+    new->chars = (char *)malloc(new->max_chars);
+    new->max = INIT_SLOTS;
+    new->starts = (size_t *)malloc(new->max * sizeof(size_t));
+    new->lens = (int *)malloc(new->max * sizeof(int));
+    assert(new->chars && new->starts && new->lens);
+    new->num = INT_ZER;
+    new->num_chars = INT_ZER;
+    new->end = STMNT_END;
+    new->sorted = NULL;
+    new->spare = NULL;
+    new->lines = NULL;
+    new->line_lens = NULL;
+    new->max_sorted = INT_ZER;
+    new->line_size = OUTPUT_LINE;
+    return new;
+}
+
+/* Free batch of lines */
+void free_batch(batch_t *batch) {
+    free(batch->chars);
+    free(batch->starts);
+    free(batch->lens);
+    free(batch->sorted);
+    free(batch->spare);
+    free(batch->lines);
+    free(batch->line_lens);
+    free(batch);
+}
+
+/* Sort prompts of a batch by their first KEY_CHARS characters a digit at a 
+time from the lowest, keeping order of prompts sharing them, and make room 
+for line of each prompt */
+void sort_batch(batch_t *batch) {
+    if (batch->num > batch->max_sorted) {
+        batch->max_sorted = batch->max;
+        batch->sorted = (prompt_t *)realloc(batch->sorted, 
+                                            batch->max * sizeof(prompt_t));
+        batch->spare = (prompt_t *)realloc(batch->spare, 
+                                           batch->max * sizeof(prompt_t));
+        batch->lines = (char *)realloc(batch->lines, (size_t)batch->max * 
+                                       batch->line_size);
+        batch->line_lens = (int *)realloc(batch->line_lens, 
+                                          batch->max * sizeof(int));
+        assert(batch->sorted && batch->spare && batch->lines && 
+               batch->line_lens);
+    }
+    for (int i = 0; i < batch->num; i++) {
+        const char *chars = batch->chars + batch->starts[i];
+        int len = batch->lens[i] < OUTPUT_MAX ? batch->lens[i] : OUTPUT_MAX;
+        uint64_t key = 0;
+        for (int j = 0; j < KEY_CHARS; j++) {
+            key = key << CHAR_BITS | (j < len ? (unsigned char)chars[j] : 0);
+        }
+        batch->sorted[i] = (prompt_t){key, len, i};
+    }
+    prompt_t *from = batch->sorted, *to = batch->spare;
+    for (int shift = 0; shift < KEY_BITS; shift += DIGIT_BITS) {
+        int starts[DIGITS] = {INT_ZER}, skip = FALSE;
+        for (int i = 0; i < batch->num; i++) {
+            starts[(from[i].key >> shift) & (DIGITS - INT_ONE)]++;
+        }
+        /* Digit every prompt has in common leaves order as it is */
+        for (int d = 0, start = 0; d < DIGITS; d++) {
+            skip |= starts[d] == batch->num;
+            int count = starts[d];
+            starts[d] = start;
+            start += count;
+        }
+        if (skip) continue;
+        for (int i = 0; i < batch->num; i++) {
+            to[starts[(from[i].key >> shift) & (DIGITS - INT_ONE)]++] = from[i];
+        }
+        prompt_t *swap = from;
+        from = to;
+        to = swap;
+    }
+    batch->sorted = from;
+    batch->spare = to;
+}
+
+/* Concurrent construction functions *****************************************/
+/* Build a shard of statements on each thread, then splice shards into the 
+shard of the first statement, whose first node heads automaton */
+automaton_t *construct_in_shards(batch_t *batch, int num_shards) {
+    builder_t builders[THREADS_MAX];
+    char shard_of[ASCII_MAX];
+    get_shards(batch, shard_of, num_shards);
+    for (int i = 0; i < num_shards; i++) {
+        builders[i].batch = batch;
+        builders[i].shard_of = shard_of;
+        builders[i].shard = i;
+    }
+    /* Calling thread builds first shard itself */
+    for (int i = 1; i < num_shards; i++) {
+        int failed = pthread_create(&builders[i].thread, NULL, run_builder, 
+                                    &builders[i]);
+        assert(!failed);
+    }
+    run_builder(&builders[INT_ZER]);
+    for (int i = 1; i < num_shards; i++) {
+        pthread_join(builders[i].thread, NULL);
+    }
+
+    /* Only the first statement can be empty, it counts but adds no node */
+    int first = (batch->num && !batch->lens[INT_ZER]) ? INT_ONE : INT_ZER;
+    int base = (first < batch->num) ? 
+        shard_of[(int)batch->chars[batch->starts[first]]] : INT_ZER;
+    automaton_t *automaton = builders[base].automaton;
+    for (int i = 0; i < num_shards; i++) {
+        if (i == base) continue;
+        splice_shard(automaton, builders[i].automaton);
+        add_stats(&automaton->stats, &builders[i].automaton->stats);
+        free_automaton(builders[i].automaton);
+    }
+    automaton->total->statement += first;
+    automaton->total->freq += first;
+    return automaton;
+}
+
+/* Build automaton of statements whose first character is in a shard */
+void *run_builder(void *arg) {
+    builder_t *builder = (builder_t *)arg;
+    batch_t *batch = builder->batch;
+    builder->automaton = get_new_automaton();
+    for (int i = 0; i < batch->num; i++) {
+        char *line = batch->chars + batch->starts[i];
+        if (batch->lens[i] && builder->shard_of[(int)*line] == builder->shard) {
+            insert_statement(builder->automaton, line, batch->lens[i]);
+        }
+    }
+    return NULL;
+}
+
+/* Assign first characters to shards, heaviest first to the lightest shard, 
+so shards hold about the same number of characters */
+void get_shards(batch_t *batch, char *shard_of, int num_shards) {
+    size_t weight[ASCII_MAX] = {INT_ZER}, load[THREADS_MAX] = {INT_ZER};
+    int done[ASCII_MAX] = {FALSE};
+    for (int i = 0; i < batch->num; i++) {
+        if (batch->lens[i]) {
+            weight[(int)batch->chars[batch->starts[i]]] += batch->lens[i];
+        }
+    }
+    for (int n = 0; n < ASCII_MAX; n++) {
+        int c = INT_ZER, shard = INT_ZER;
+        for (int i = 0; i < ASCII_MAX; i++) {
+            if (!done[i] && (done[c] || weight[i] > weight[c])) c = i;
+        }
+        for (int i = 0; i < num_shards; i++) {
+            if (load[i] < load[shard]) shard = i;
+        }
+        done[c] = TRUE;
+        shard_of[c] = shard;
+        load[shard] += weight[c];
+    }
+}
+
+/* Move all nodes of a shard into automaton, adding its first nodes to root 
+list. Shards share no first character, so no node of the shard is merged */
+void splice_shard(automaton_t *automaton, automaton_t *shard) {
+    memory_t *to = automaton->memory, *from = shard->memory;
+    if (!shard->outputs->head) return;
+    /* Strings are single characters held inline during construction */
+    assert(from->num_chars == (INT_ONE << STR_MIN_BITS));
+    char *released = (char *)calloc(from->nodes.num, sizeof(char));
+    char *smalls_released = (char *)calloc(from->smalls.num, sizeof(char));
+    char *bigs_released = (char *)calloc(from->bigs.num, sizeof(char));
+    assert(released && smalls_released && bigs_released);
+    uint32_t offset = append_pool(&to->nodes, &from->nodes, released);
+    uint32_t smalls_offset = append_pool(&to->smalls, &from->smalls, 
+                                         smalls_released);
+    uint32_t bigs_offset = append_pool(&to->bigs, &from->bigs, bigs_released);
+
+    /* Shift links of appended nodes and lookups to their new indices */
+    for (uint32_t ref = INT_ONE; ref < from->nodes.num; ref++) {
+        if (released[ref]) continue;
+        node_t *node = get_node(automaton, ref + offset);
+        if (node->down) node->down += offset;
+        if (node->right) node->right += offset;
+        if (node->left) node->left += offset;
+        if (node->lookup & BIG_LOOKUP) {
+            node->lookup += bigs_offset;
+        } else if (node->lookup) {
+            node->lookup += smalls_offset;
+        }
+    }
+    for (uint32_t i = INT_ONE; i < from->smalls.num; i++) {
+        if (smalls_released[i]) continue;
+        small_t *small = (small_t *)to->smalls.slots + i + smalls_offset;
+        small->best += offset;
+        for (uint32_t j = 0; j < small->count; j++) small->refs[j] += offset;
+    }
+    for (uint32_t i = INT_ONE; i < from->bigs.num; i++) {
+        if (bigs_released[i]) continue;
+        big_t *big = (big_t *)to->bigs.slots + i + bigs_offset;
+        big->best += offset;
+        for (int j = 0; j < ASCII_MAX; j++) {
+            if (big->refs[j]) big->refs[j] += offset;
+        }
+    }
+    free(released);
+    free(smalls_released);
+    free(bigs_released);
+
+    /* Move first nodes of shard, one by one, into root list of automaton */
+    node_t *anchor = get_node(automaton, shard->outputs->head + offset);
+    node_t *head = get_node(automaton, automaton->outputs->head);
+    free_lookup(automaton, anchor->lookup);
+    anchor->lookup = NIL;
+    node_t *left = get_node(automaton, anchor->left);
+    node_t *right = get_node(automaton, anchor->right);
+    anchor->left = anchor->right = NIL;
+    insert_sibling(automaton, head, anchor);
+    while (left) {
+        node_t *next = get_node(automaton, left->left);
+        left->left = left->right = NIL;
+        insert_sibling(automaton, head, left);
+        left = next;
+    }
+    while (right) {
+        node_t *next = get_node(automaton, right->right);
+        right->left = right->right = NIL;
+        insert_sibling(automaton, head, right);
+        right = next;
+    }
+    automaton->total->state += shard->total->state - INT_ONE;
+    automaton->total->freq += shard->total->freq;
+    automaton->total->statement += shard->total->statement;
+    automaton->total->character += shard->total->character;
+}
+
+/* Input functions ***********************************************************/
+/* Create new reader of an input stream */
+reader_t *get_new_reader(FILE *fp) {
+    reader_t *new = (reader_t *)malloc(sizeof(*new));
+    assert(new);
+    new->fp = fp;
+    new->max = READ_BLOCK;
+    new->buf = (char *)malloc(new->max);
+    assert(new->buf);
+    new->pos = new->end = INT_ZER;
+    new->eof = new->previously_newline = FALSE;
+    new->stage_num = STAGE_0;
+    return new;
+}
+
+/* Create new reader of text in memory, read as a last stage so that text 
+may end without a newline */
+reader_t *get_text_reader(const char *text, size_t len) {
+    reader_t *new = get_new_reader(NULL);
+    if (len > new->max) {
+        new->max = len;
+        new->buf = (char *)realloc(new->buf, new->max);
+        assert(new->buf);
+    }
+    memcpy(new->buf, text, len);
+    new->end = len;
+    new->eof = TRUE;
+    new->stage_num = STAGE_2;
+    return new;
+}
+
+/* Get next line of input without its newline, skipping carriage returns. 
+Returns STMNT_END for a line, STAGE_END for an empty line after a newline and 
+EOF at end of input. BAD_END means input is invalid after the len characters 
+of line, either a character out of ASCII range or an end of input before 
+stage 2. Line is only valid until next call */
+int get_line(reader_t *reader, char **line, int *len) {
+    char *newline;
+    size_t scanned = INT_ZER;
+    /* Search for next newline, reading further blocks until it turns up */
+    while (!(newline = memchr(reader->buf + reader->pos + scanned, NEWLIN, 
+                              reader->end - reader->pos - scanned)) && 
+           !reader->eof) {
+        scanned = reader->end - reader->pos;
+        fill_reader(reader);
+    }
+    char *start = reader->buf + reader->pos;
+    size_t stop = newline ? (size_t)(newline - reader->buf) : reader->end;
+    size_t n = stop - reader->pos;
+    reader->pos = newline ? stop + INT_ONE : stop;
+
+    /* Skip carriage returns by moving later characters forward */
+    char *from = memchr(start, CRTRNC, n), *to = from;
+    if (from) {
+        for (; from < start + n; from++) {
+            if (*from != CRTRNC) *to++ = *from;
+        }
+        n = to - start;
+    }
+    *line = start;
+    /* Ensure characters are within ASCII range */
+    for (size_t i = 0; i < n; i++) {
+        if ((unsigned char)start[i] >= ASCII_MAX) {
+            *len = i;
+            return BAD_END;
+        }
+    }
+    *len = n;
+    /* Keep track of stage changes based on input file format */
+    if (!newline) {
+        reader->previously_newline = FALSE;
+        return (reader->stage_num == STAGE_2) ? EOF : BAD_END;
+    } else if (!n && reader->previously_newline) {
+        reader->stage_num++;
+        return STAGE_END;
+    }
+    reader->previously_newline = TRUE;
+    return STMNT_END;
+}
+
+/* Read another block of input behind unconsumed input, growing buffer when 
+a single line fills it */
+void fill_reader(reader_t *reader) {
+    size_t unused = reader->end - reader->pos;
+    memmove(reader->buf, reader->buf + reader->pos, unused);
+    reader->pos = INT_ZER;
+    reader->end = unused;
+    if (reader->max - reader->end < READ_BLOCK) {
+        reader->max *= INT_TWO;
+        reader->buf = (char *)realloc(reader->buf, reader->max);
+        assert(reader->buf);
+    }
+    size_t n = fread(reader->buf + reader->end, sizeof(char), 
+                     reader->max - reader->end, reader->fp);
+    reader->end += n;
+    if (!n) reader->eof = TRUE;
+}
+
+/* Reject invalid input file after writing out all output so far */
+void invalid_input(writer_t *writer) {
+    put_format(writer, "Invalid test file, program terminated\n");
+    flush_writer(writer);
+    exit(EXIT_FAILURE);
+}
+
+/* Free reader */
+void free_reader(reader_t *reader) {
+    free(reader->buf);
+    free(reader);
+}
+
+/* Output functions **********************************************************/
+/* Create new writer, output goes to fd with write(2) unless fd is NO_FD. 
+Without fp either, output is kept in memory */
+writer_t *get_new_writer(int fd, FILE *fp) {
+    writer_t *new = (writer_t *)malloc(sizeof(*new));
+    assert(new);
+    new->fd = fd;
+    new->fp = fp;
+    new->max = WRITE_BLOCK;
+    new->buf = (char *)malloc(new->max);
+    assert(new->buf);
+    new->num = INT_ZER;
+    return new;
+}
+
+/* Add a character to output */
+void put_char(writer_t *writer, char c) {
+    if (writer->num == writer->max) flush_writer(writer);
+    writer->buf[writer->num++] = c;
+}
+
+/* Add len characters to output */
+void put_chars(writer_t *writer, const char *chars, size_t len) {
+    while (writer->num + len > writer->max) {
+        size_t n = writer->max - writer->num;
+        memcpy(writer->buf + writer->num, chars, n);
+        writer->num += n;
+        chars += n;
+        len -= n;
+        flush_writer(writer);
+    }
+    memcpy(writer->buf + writer->num, chars, len);
+    writer->num += len;
+}
+
+/* Add a line formatted as printf to output */
+void put_format(writer_t *writer, const char *format, ...) {
+    char line[FORMAT_MAX];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, FORMAT_MAX, format, args);
+    va_end(args);
+    assert(len >= 0 && len < FORMAT_MAX);
+    put_chars(writer, line, len);
+}
+
+/* Write out all buffered output */
+void flush_writer(writer_t *writer) {
+    if (writer->fd == NO_FD && !writer->fp) {
+        /* Output kept in memory grows instead */
+        writer->max *= INT_TWO;
+        writer->buf = (char *)realloc(writer->buf, writer->max);
+        assert(writer->buf);
+        return;
+    }
+    if (writer->fd == NO_FD) {
+        fwrite(writer->buf, sizeof(char), writer->num, writer->fp);
+        fflush(writer->fp);
+        writer->num = INT_ZER;
+        return;
+    }
+    size_t done = INT_ZER;
+    while (done < writer->num) {
+        ssize_t n = write(writer->fd, writer->buf + done, writer->num - done);
+        /* Retry if interrupted, give up on output that cannot be written */
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    writer->num = INT_ZER;
+}
+
+/* Write out remaining output and free writer */
+void free_writer(writer_t *writer) {
+    flush_writer(writer);
+    free(writer->buf);
+    free(writer);
+}
+
+/* Functions to get new memory spaces *****************************************/
+/* Create new node, a pointer to it is only valid until next new node */
+node_t *get_new_node(automaton_t *automaton) {
+    node_t *new = get_node(automaton, pool_alloc(&automaton->memory->nodes));
+    new->right = new->down = new->left = NIL;
+    new->len = new->lookup = NIL;
+    new->freq = new->ends = INT_ZER;
+    COUNT(&automaton->stats, CNT_NODES, INT_ONE);
+    return new;
+}
+
+/* Get node by its index, NULL if there is no such node */
+node_t *get_node(automaton_t *automaton, ref_t ref) {
+    return ref ? (node_t *)automaton->memory->nodes.slots + ref : NULL;
+}
+
+/* Get index of a node, NIL if there is no such node */
+ref_t get_ref(automaton_t *automaton, node_t *node) {
+    return node ? (ref_t)(node - (node_t *)automaton->memory->nodes.slots) 
+                : NIL;
+}
+
+/* Get transition string of a node, only valid until next new node or string */
+char *get_str(automaton_t *automaton, node_t *node) {
+    if (node->len <= INLINE_MAX) return node->chars;
+    return automaton->memory->chars + node->str;
+}
+
+/* Create new automaton */
+automaton_t *get_new_automaton(void) {
+    automaton_t *automaton = (automaton_t *)malloc(sizeof(*automaton));
+    assert(automaton);
+    automaton->outputs = get_new_list();
+    automaton->total = get_new_totals(); 
+    automaton->memory = get_new_memory();
+    automaton->memo = get_new_memo();
+    automaton->version = INT_ZER;
+    automaton->path = get_new_path();
+    automaton->frozen = NULL;
+    memset(&automaton->stats, 0, sizeof(automaton->stats));
+    automaton->radix = NULL;
+    automaton->ranks = NULL;
+    return automaton;
+}
+
+/* Copy an automaton to be changed while it is still read. Nodes keep their 
+index, so the copy is a copy of each array, and any snapshot it is mapped 
+from is left alone */
+automaton_t *clone_automaton(automaton_t *automaton) {
+    assert(!automaton->frozen);
+    automaton_t *new = (automaton_t *)malloc(sizeof(*new));
+    memory_t *memory = (memory_t *)malloc(sizeof(*memory));
+    assert(new && memory);
+    *new = *automaton;
+    new->outputs = get_new_list();
+    *new->outputs = *automaton->outputs;
+    new->total = get_new_totals();
+    *new->total = *automaton->total;
+    *memory = *automaton->memory;
+    thaw_array(&memory->nodes.slots, memory->nodes.max * memory->nodes.size);
+    thaw_array(&memory->smalls.slots, 
+               memory->smalls.max * memory->smalls.size);
+    thaw_array(&memory->bigs.slots, memory->bigs.max * memory->bigs.size);
+    thaw_array(&memory->chars, memory->max_chars);
+    memory->map = NULL;
+    memory->map_size = INT_ZER;
+    new->memory = memory;
+    new->memo = get_new_memo();
+    new->path = get_new_path();
+    if (automaton->radix) new->radix = clone_radix(automaton, automaton->radix);
+    new->ranks = NULL;
+    return new;
+}
+
+/* Copy merged nodes of an automaton */
+radix_t *clone_radix(automaton_t *automaton, radix_t *radix) {
+    radix_t *new = get_new_radix();
+    for (ref_t ref = INT_ONE; ref < radix->max; ref++) {
+        if (!radix->chains[ref]) continue;
+        size_t size = (get_node(automaton, ref)->len - INT_ONE) * 
+                      sizeof(merged_t);
+        merged_t *chain = (merged_t *)malloc(size);
+        assert(chain);
+        memcpy(chain, radix->chains[ref], size);
+        set_chain(new, ref, chain);
+    }
+    return new;
+}
+
+/* Create new list */
+list_t *get_new_list(void) {
+    list_t *new = (list_t *)malloc(sizeof(*new));
+    assert(new);
+    new->head = new->tail = new->anchor = NIL;
+    return new;
+}
+
+/* Create new empty path of latest statement */
+path_t *get_new_path(void) {
+    path_t *new = (path_t *)malloc(sizeof(*new));
+    assert(new);
+    new->max = INIT_SLOTS;
+    new->chars = (char *)malloc(new->max);
+    new->nodes = (ref_t *)malloc(new->max * sizeof(ref_t));
+    new->anchors = (ref_t *)malloc(new->max * sizeof(ref_t));
+    assert(new->chars && new->nodes && new->anchors);
+    new->len = INT_ZER;
+    return new;
+}
+
+/* Free path of latest statement */
+void free_path(path_t *path) {
+    free(path->chars);
+    free(path->nodes);
+    free(path->anchors);
+    free(path);
+}
+
+/* Create new empty freq of merged nodes */
+radix_t *get_new_radix(void) {
+    radix_t *new = (radix_t *)malloc(sizeof(*new));
+    assert(new);
+    *new = (radix_t){NULL, INT_ZER, NULL, INT_ZER};
+    return new;
+}
+
+/* Create new totals */
+total_t *get_new_totals(void) {
+    total_t *new = (total_t *)malloc(sizeof(*new));
+    assert(new);
+    new->statement = new->freq = new->character = INT_ZER;
+    new->merged_state = new->merged_freq = INT_ZER;
+    new->state = INT_ONE;
+    return new;
+}
+
+/* Create new pools and string arena, slot 0 of each stands for none */
+memory_t *get_new_memory(void) {
+    memory_t *new = (memory_t *)malloc(sizeof(*new));
+    assert(new);
+    init_pool(&new->nodes, sizeof(node_t));
+    init_pool(&new->smalls, sizeof(small_t));
+    init_pool(&new->bigs, sizeof(big_t));
+    new->chars = (char *)malloc(INIT_CHARS * sizeof(char));
+    assert(new->chars);
+    new->num_chars = INT_ONE << STR_MIN_BITS;
+    new->max_chars = INIT_CHARS;
+    for (int i = 0; i < STR_CLASSES; i++) new->freed_str[i] = NIL;
+    new->map = NULL;
+    new->map_size = INT_ZER;
+    return new;
+}
+
+/* Create new empty cache of generated text */
+memo_t *get_new_memo(void) {
+    memo_t *new = (memo_t *)malloc(sizeof(*new));
+    assert(new);
+    new->num_sets = INT_ONE;
+    while ((new->num_sets * INT_TWO) * MEMO_WAYS * sizeof(completion_t) <= 
+           MEMO_MAX) {
+        new->num_sets *= INT_TWO;
+    }
+    new->slots = (completion_t *)calloc(new->num_sets * MEMO_WAYS, 
+                                        sizeof(completion_t));
+    assert(new->slots);
+    new->clock = INT_ZER;
+    return new;
+}
+
+/* Drop all cached text */
+void clear_memo(memo_t *memo) {
+    memset(memo->slots, 0, memo->num_sets * MEMO_WAYS * sizeof(completion_t));
+}
+
+/* Free cache of generated text */
+void free_memo(memo_t *memo) {
+    free(memo->slots);
+    free(memo);
+}
+
+/* Create new empty cache of answered prompts */
+answers_t *get_new_answers(void) {
+    answers_t *new = (answers_t *)malloc(sizeof(*new));
+    assert(new);
+    size_t set_size = sizeof(tags_t) + ANSWER_WAYS * sizeof(answer_t);
+    new->num_sets = INT_ONE;
+    while ((new->num_sets * INT_TWO) * set_size <= ANSWERS_MAX) {
+        new->num_sets *= INT_TWO;
+    }
+    new->tags = (tags_t *)calloc(new->num_sets, sizeof(tags_t));
+    new->slots = (answer_t *)malloc(new->num_sets * ANSWER_WAYS * 
+                                    sizeof(answer_t));
+    assert(new->tags && new->slots);
+    new->clock = INT_ZER;
+    return new;
+}
+
+/* Drop all cached answers */
+void clear_answers(answers_t *answers) {
+    memset(answers->tags, 0, answers->num_sets * sizeof(tags_t));
+}
+
+/* Free cache of answered prompts */
+void free_answers(answers_t *answers) {
+    free(answers->tags);
+    free(answers->slots);
+    free(answers);
+}
+
+/* Find cached answer of a prompt of up to OUTPUT_MAX characters. Returns 
+NULL if prompt is seen for the first time, otherwise its answer, left with no 
+line for caller to print into if it has none yet */
+answer_t *get_answer(answers_t *answers, const char *prompt, int len) {
+    /* Hash prompt a word at a time */
+    uint64_t hash = len;
+    for (int i = 0; i < len; i += sizeof(uint64_t)) {
+        uint64_t word = 0;
+        memcpy(&word, prompt + i, len - i < (int)sizeof(word) ? len - i : 
+               (int)sizeof(word));
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 29;
+    }
+    uint32_t tag = hash >> 32, set = hash & (answers->num_sets - INT_ONE);
+    tags_t *tags = answers->tags + set;
+    answer_t *slots = answers->slots + set * ANSWER_WAYS;
+    int victim = 0;
+    answers->clock++;
+    for (int i = 0; i < ANSWER_WAYS; i++) {
+        if (tags->used[i] && tags->hashes[i] == tag) {
+            tags->used[i] = answers->clock;
+            if ((tags->stored >> i & INT_ONE) && slots[i].prompt_len == len && 
+                !memcmp(slots[i].prompt, prompt, len)) {
+                return &slots[i];
+            }
+            /* Seen before, or another prompt of the same hash */
+            tags->stored |= INT_ONE << i;
+            slots[i].prompt_len = len;
+            slots[i].len = INT_ZER;
+            memcpy(slots[i].prompt, prompt, len);
+            return &slots[i];
+        }
+        if (tags->used[i] < tags->used[victim]) victim = i;
+    }
+    tags->used[victim] = answers->clock;
+    tags->hashes[victim] = tag;
+    tags->stored &= ~(INT_ONE << victim);
+    return NULL;
+}
+
+/* Create new trail with no prompt matched yet */
+trail_t *get_new_trail(void) {
+    trail_t *new = (trail_t *)malloc(sizeof(*new));
+    assert(new);
+    new->len = INT_ZER;
+    return new;
+}
+
+/* Create new empty room to rank completions, grown as ranking needs */
+ranking_t *get_new_ranking(void) {
+    ranking_t *new = (ranking_t *)calloc(INT_ONE, sizeof(*new));
+    assert(new);
+    return new;
+}
+
+/* Free room to rank completions, if any */
+void free_ranking(ranking_t *ranking) {
+    if (!ranking) return;
+    free(ranking->lists);
+    free(ranking->heap);
+    free(ranking);
+}
+
+/* Convert single character to an inline string */
+void get_string(node_t *node, char c) {
+    node->len = INT_ONE;
+    node->chars[INT_ZER] = c;
+}
+
+/* Combine two strings, re-order string1 before string2, into p2. If adopt, 
+p1 is about to be deleted so its space is reused. Since space comes in powers 
+of two, a string that keeps adopting grows in place at amortized O(1) cost per 
+added character */
+void combine_str(automaton_t *automaton, node_t *p1, node_t *p2, int adopt) {
+    uint32_t len = p1->len + p2->len;
+    char *chars = automaton->memory->chars;
+    if (len <= INLINE_MAX) {
+        memmove(p2->chars + p1->len, p2->chars, p2->len);
+        memcpy(p2->chars, p1->chars, p1->len);
+        COUNT(&automaton->stats, CNT_COMBINED, len);
+    } else if (adopt && p1->len > INLINE_MAX && 
+               get_str_class(len) == get_str_class(p1->len)) {
+        memcpy(chars + p1->str + p1->len, get_str(automaton, p2), p2->len);
+        COUNT(&automaton->stats, CNT_COMBINED, p2->len);
+        free_str(automaton, p2);
+        p2->str = p1->str;
+        p1->len = INT_ZER;
+    } else {
+        uint32_t str = get_new_str(automaton, len);
+        chars = automaton->memory->chars;
+        memcpy(chars + str, get_str(automaton, p1), p1->len);
+        memcpy(chars + str + p1->len, get_str(automaton, p2), p2->len);
+        COUNT(&automaton->stats, CNT_COMBINED, len);
+        free_str(automaton, p2);
+        p2->str = str;
+    }
+    p2->len = len;
+}
+
+/* Get space for a string of len characters from its size class */
+uint32_t get_new_str(automaton_t *automaton, size_t len) {
+    memory_t *memory = automaton->memory;
+    int class = get_str_class(len);
+    uint32_t str = memory->freed_str[class];
+    /* Reuse a released string, its first bytes link to the next one */
+    if (str) {
+        memcpy(&memory->freed_str[class], memory->chars + str, sizeof(str));
+        return str;
+    }
+    COUNT(&automaton->stats, CNT_STRS, INT_ONE);
+    size_t size = (size_t)INT_ONE << (class + STR_MIN_BITS);
+    while (memory->num_chars + size > memory->max_chars) {
+        assert(memory->max_chars <= UINT32_MAX / INT_TWO);
+        memory->max_chars *= INT_TWO;
+        memory->chars = (char *)realloc(memory->chars, memory->max_chars);
+        assert(memory->chars);
+        COUNT(&automaton->stats, CNT_GROWS, INT_ONE);
+    }
+    str = memory->num_chars;
+    memory->num_chars += size;
+    return str;
+}
+
+/* Return space of a node's string to its size class, inline ones have none */
+void free_str(automaton_t *automaton, node_t *node) {
+    memory_t *memory = automaton->memory;
+    if (node->len <= INLINE_MAX) return;
+    int class = get_str_class(node->len);
+    memcpy(memory->chars + node->str, &memory->freed_str[class], 
+           sizeof(node->str));
+    memory->freed_str[class] = node->str;
+}
+
+/* Find smallest size class that fits len characters */
+int get_str_class(size_t len) {
+    int class = 0;
+    while (((size_t)INT_ONE << (class + STR_MIN_BITS)) < len) class++;
+    assert(class < STR_CLASSES);
+    return class;
+}
+
+/* Memory pool functions *****************************************************/
+/* Prepare a pool of fixed size slots, slot 0 is never handed out */
+void init_pool(pool_t *pool, size_t size) {
+    pool->size = size;
+    pool->slots = (char *)malloc(INIT_SLOTS * size);
+    assert(pool->slots);
+    pool->num = INT_ONE;
+    pool->max = INIT_SLOTS;
+    pool->freed = NIL;
+}
+
+/* Take a slot from pool, reusing released slots before growing the array */
+uint32_t pool_alloc(pool_t *pool) {
+    uint32_t ref = pool->freed;
+    /* A released slot holds the index of the next released one */
+    if (ref) {
+        memcpy(&pool->freed, pool->slots + ref * pool->size, sizeof(ref));
+        return ref;
+    }
+    if (pool->num == pool->max) {
+        assert(pool->max <= UINT32_MAX / INT_TWO);
+        pool->max *= INT_TWO;
+        pool->slots = (char *)realloc(pool->slots, pool->max * pool->size);
+        assert(pool->slots);
+    }
+    return pool->num++;
+}
+
+/* Copy all slots of one pool to the end of another, returning how much 
+their indices grow. Released slots are marked and stay released */
+uint32_t append_pool(pool_t *to, pool_t *from, char *released) {
+    uint32_t offset = to->num - INT_ONE, num = from->num - INT_ONE;
+    while (to->num + num > to->max) {
+        assert(to->max <= UINT32_MAX / INT_TWO);
+        to->max *= INT_TWO;
+    }
+    to->slots = (char *)realloc(to->slots, to->max * to->size);
+    assert(to->slots);
+    memcpy(to->slots + to->num * to->size, from->slots + from->size, 
+           num * from->size);
+    to->num += num;
+    uint32_t ref = from->freed;
+    while (ref) {
+        released[ref] = TRUE;
+        memcpy(&ref, from->slots + ref * from->size, sizeof(ref));
+    }
+    for (ref = INT_ONE; ref <= num; ref++) {
+        if (released[ref]) pool_release(to, ref + offset);
+    }
+    return offset;
+}
+
+/* Put a slot back into pool for later reuse */
+void pool_release(pool_t *pool, uint32_t ref) {
+    memcpy(pool->slots + ref * pool->size, &pool->freed, sizeof(ref));
+    pool->freed = ref;
+}
+
+/* Child lookup functions ****************************************************/
+/* Get last character of a transition string, which tells siblings apart */
+char get_key(automaton_t *automaton, node_t *node) {
+    return get_str(automaton, node)[node->len - INT_ONE];
+}
+
+/* Find sibling whose key is a character, searching from the list's anchor */
+ref_t find_child(automaton_t *automaton, node_t *anchor, char key) {
+    if (!anchor->lookup) {
+        return (key == get_key(automaton, anchor)) ? 
+                    get_ref(automaton, anchor) : NIL;
+    } else if (anchor->lookup & BIG_LOOKUP) {
+        big_t *big = (big_t *)automaton->memory->bigs.slots + 
+                        (anchor->lookup & ~BIG_LOOKUP);
+        return big->refs[(int)key];
+    }
+    small_t *small = (small_t *)automaton->memory->smalls.slots + 
+                        anchor->lookup;
+    int i = find_key(small->keys, small->count, key);
+    return (i == NO_KEY) ? NIL : small->refs[i];
+}
+
+/* Find sibling with the smallest key above a character */
+ref_t find_successor(automaton_t *automaton, node_t *anchor, char key) {
+    if (!anchor->lookup) {
+        return (key < get_key(automaton, anchor)) ? 
+                    get_ref(automaton, anchor) : NIL;
+    } else if (anchor->lookup & BIG_LOOKUP) {
+        big_t *big = (big_t *)automaton->memory->bigs.slots + 
+                        (anchor->lookup & ~BIG_LOOKUP);
+        for (int i = key + INT_ONE; i < ASCII_MAX; i++) {
+            if (big->refs[i]) return big->refs[i];
+        }
+        return NIL;
+    }
+    small_t *small = (small_t *)automaton->memory->smalls.slots + 
+                        anchor->lookup;
+    uint32_t i = find_above(small->keys, small->count, key);
+    return (i < small->count) ? small->refs[i] : NIL;
+}
+
+/* Find index of a key among count ascending keys of a small lookup, or 
+NO_KEY. SSE2 is taken where the processor has it, which every x86-64 does */
+int find_key(const char *keys, uint32_t count, char key) {
+#if defined(SIMD_LOOKUP) && SMALL_MAX == 16
+    if (HAS_SSE2) return find_key_sse2(keys, count, key);
+#endif
+    return find_key_scalar(keys, count, key);
+}
+
+/* Find index of the first of count ascending keys above a character, or 
+count if there is none */
+uint32_t find_above(const char *keys, uint32_t count, char key) {
+#if defined(SIMD_LOOKUP) && SMALL_MAX == 16
+    if (HAS_SSE2) return find_above_sse2(keys, count, key);
+#endif
+    return find_above_scalar(keys, count, key);
+}
+
+/* Find index of a key by binary search */
+int find_key_scalar(const char *keys, uint32_t count, char key) {
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = (lo + hi) / INT_TWO;
+        if (keys[mid] == key) return mid;
+        if (keys[mid] < key) lo = mid + INT_ONE;
+        else hi = mid;
+    }
+    return NO_KEY;
+}
+
+/* Find index of the first key above a character by linear scan */
+uint32_t find_above_scalar(const char *keys, uint32_t count, char key) {
+    uint32_t i = 0;
+    while (i < count && keys[i] <= key) i++;
+    return i;
+}
+
+#ifdef SIMD_LOOKUP
+/* Find index of a key comparing all SMALL_MAX keys at once, those past 
+count are masked off */
+__attribute__((target("sse2")))
+int find_key_sse2(const char *keys, uint32_t count, char key) {
+    __m128i same = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)keys), 
+                                  _mm_set1_epi8(key));
+    uint32_t mask = _mm_movemask_epi8(same) & ((INT_ONE << count) - INT_ONE);
+    return mask ? __builtin_ctz(mask) : NO_KEY;
+}
+
+/* Find index of the first key above a character comparing all keys at 
+once. Keys are ASCII, so signed bytes compare alike */
+__attribute__((target("sse2")))
+uint32_t find_above_sse2(const char *keys, uint32_t count, char key) {
+    __m128i above = _mm_cmpgt_epi8(_mm_loadu_si128((const __m128i *)keys), 
+                                   _mm_set1_epi8(key));
+    uint32_t mask = _mm_movemask_epi8(above) & ((INT_ONE << count) - INT_ONE);
+    return mask ? (uint32_t)__builtin_ctz(mask) : count;
+}
+#endif
+
+/* Record a new sibling in lookup of its anchor, growing the lookup if full */
+void add_child(automaton_t *automaton, node_t *anchor, char key, ref_t ref) {
+    memory_t *memory = automaton->memory;
+    /* A second sibling turns the anchor into a small lookup */
+    if (!anchor->lookup) {
+        anchor->lookup = pool_alloc(&memory->smalls);
+        COUNT(&automaton->stats, CNT_LOOKUPS, INT_ONE);
+        small_t *small = (small_t *)memory->smalls.slots + anchor->lookup;
+        small->best = get_ref(automaton, anchor);
+        small->count = INT_ONE;
+        small->keys[INT_ZER] = get_key(automaton, anchor);
+        small->refs[INT_ZER] = get_ref(automaton, anchor);
+    }
+    if (anchor->lookup & BIG_LOOKUP) {
+        big_t *big = (big_t *)memory->bigs.slots + 
+                        (anchor->lookup & ~BIG_LOOKUP);
+        big->refs[(int)key] = ref;
+        return;
+    }
+    small_t *small = (small_t *)memory->smalls.slots + anchor->lookup;
+    /* A full small lookup is replaced by a direct table */
+    if (small->count == SMALL_MAX) {
+        uint32_t lookup = pool_alloc(&memory->bigs);
+        COUNT(&automaton->stats, CNT_LOOKUPS, INT_ONE);
+        small = (small_t *)memory->smalls.slots + anchor->lookup;
+        big_t *big = (big_t *)memory->bigs.slots + lookup;
+        memset(big->refs, 0, sizeof(big->refs));
+        big->best = small->best;
+        for (uint32_t i = 0; i < small->count; i++) {
+            big->refs[(int)small->keys[i]] = small->refs[i];
+        }
+        big->refs[(int)key] = ref;
+        pool_release(&memory->smalls, anchor->lookup);
+        anchor->lookup = lookup | BIG_LOOKUP;
+        return;
+    }
+    /* Otherwise shift larger keys up to keep keys in ascending order */
+    int i = small->count++;
+    for (; i > 0 && small->keys[i - INT_ONE] > key; i--) {
+        small->keys[i] = small->keys[i - INT_ONE];
+        small->refs[i] = small->refs[i - INT_ONE];
+        COUNT(&automaton->stats, CNT_INSERT_SHIFTS, INT_ONE);
+    }
+    small->keys[i] = key;
+    small->refs[i] = ref;
+}
+
+/* Get cached best sibling of a list, NULL for a lone node as it is its own */
+ref_t *get_best(automaton_t *automaton, node_t *anchor) {
+    if (!anchor->lookup) return NULL;
+    if (anchor->lookup & BIG_LOOKUP) {
+        return &((big_t *)automaton->memory->bigs.slots + 
+                    (anchor->lookup & ~BIG_LOOKUP))->best;
+    }
+    return &((small_t *)automaton->memory->smalls.slots + anchor->lookup)->best;
+}
+
+/* Keep best sibling up to date after a node is added or its freq grows. As 
+freq only grows during construction, comparing against current best is enough. 
+Compression keeps each list intact, so it needs no fix up */
+void update_best(automaton_t *automaton, node_t *anchor, node_t *node) {
+    ref_t *best_ref = get_best(automaton, anchor);
+    if (!best_ref) return;
+    node_t *best = get_node(automaton, *best_ref);
+    if (node->freq > best->freq || (node->freq == best->freq && 
+        get_key(automaton, node) > get_key(automaton, best))) {
+        *best_ref = get_ref(automaton, node);
+    }
+}
+
+/* Release a child lookup of either kind */
+void free_lookup(automaton_t *automaton, uint32_t lookup) {
+    if (lookup & BIG_LOOKUP) {
+        pool_release(&automaton->memory->bigs, lookup & ~BIG_LOOKUP);
+    } else if (lookup) {
+        pool_release(&automaton->memory->smalls, lookup);
+    }
+}
+
+/* Insertion functions *******************************************************/
+/* Insert new node directly below previous node pointed by tail pointer */
+automaton_t *insert_vertically(automaton_t *automaton, char c) {
+    assert(automaton);
+    node_t *newnode = get_new_node(automaton);
+    get_string(newnode, c);
+    ref_t new_ref = get_ref(automaton, newnode);
+    node_t *tail = get_node(automaton, automaton->outputs->tail);
+    automaton->total->state++; 
+    /* Update frequency of previous node if traversed pass */
+    if (tail) {
+        tail->freq++;
+        automaton->total->freq++;
+        update_best(automaton, 
+                    get_node(automaton, automaton->outputs->anchor), tail);
+    } 
+    /* Assign tail pointer to new node. If root node, also assign head */ 
+    if (!automaton->outputs->head) {
+        automaton->outputs->head = automaton->outputs->tail = new_ref;
+    } else {
+        tail->down = new_ref;
+        automaton->outputs->tail = new_ref;
+    } 
+    automaton->outputs->anchor = new_ref;
+    return automaton;
+}
+
+/* Insert new node to left or right of previous node pointed by tail pointer */
+automaton_t *insert_horizontally(automaton_t *automaton, char c, 
+                                   int *compare_root, int *invert_vertical) {
+    assert(automaton);
+    node_t *new_node = get_new_node(automaton), *curr_node;
+    get_string(new_node, c);
+    node_t *tail = get_node(automaton, automaton->outputs->tail);
+    automaton->total->state++; 
+    
+    /* Reassign curr_node to root node for every new statement */
+    if (*compare_root) {
+        curr_node = get_node(automaton, automaton->outputs->head);
+    } else {
+        /* Ensure valid addition of new node below leaf node */
+        if (!tail->down) {
+            tail->down = automaton->outputs->tail = 
+                automaton->outputs->anchor = get_ref(automaton, new_node);
+            /* From now on, insert vertically */
+            *invert_vertical = TRUE;
+            return automaton;
+        } 
+        curr_node = get_node(automaton, tail->down); 
+    } 
+    
+    /* During processing of each prompt, update freq of previous node */
+    if (get_ref(automaton, curr_node) != automaton->outputs->head) {
+        tail->freq++;
+        automaton->total->freq++;
+        update_best(automaton, 
+                    get_node(automaton, automaton->outputs->anchor), tail);
+    } 
+    automaton->outputs->anchor = get_ref(automaton, curr_node);
+    /* Look up sibling with the same transition string via its anchor */
+    node_t *same = get_node(automaton, find_child(automaton, curr_node, c));
+    /* If equal, reassign tail to current node */
+    if (same) {
+        insert_equal_result(automaton, same, new_node);
+        *compare_root = FALSE;
+    } else {
+        insert_unequal_result(automaton, curr_node, new_node, invert_vertical);
+    }
+    return automaton;
+}
+
+/* Remove any already existing state for equal result */
+void insert_equal_result(automaton_t *automaton, node_t *curr, node_t *new) {
+    assert(automaton && curr && new);
+    automaton->total->state--; 
+    automaton->outputs->tail = get_ref(automaton, curr); 
+    free_node(automaton, new);
+}
+
+/* Insert new node next to its successor, keeping ascending ASCII order for 
+left-hand side and descending ASCII order for right-hand side of anchor */
+void insert_unequal_result(automaton_t *automaton, node_t *anchor, 
+                           node_t *new, int *insert_vertical) {
+    insert_sibling(automaton, anchor, new);
+    automaton->outputs->tail = get_ref(automaton, new);
+    *insert_vertical = TRUE;
+}
+
+/* Add a new node to list of anchor at its place in ASCII order */
+void insert_sibling(automaton_t *automaton, node_t *anchor, node_t *new) {
+    char key = get_key(automaton, new);
+    node_t *next = get_node(automaton, find_successor(automaton, anchor, key));
+    if (key < get_key(automaton, anchor)) {
+        insert_beside(automaton, new, next, LEFT);
+    } else {
+        insert_beside(automaton, new, next ? next : anchor, RIGHT);
+    }
+    add_child(automaton, anchor, key, get_ref(automaton, new));
+    update_best(automaton, anchor, new);
+}
+
+/* Insert new node in-between an existing node and its left or right node */
+void insert_beside(automaton_t *automaton, node_t *new_node, 
+                   node_t *curr_node, int side) {
+    assert(new_node && curr_node);
+    ref_t new_ref = get_ref(automaton, new_node);
+    if (side == LEFT) {
+        new_node->left = curr_node->left; 
+        new_node->right = get_ref(automaton, curr_node); 
+        if (curr_node->left) {
+            get_node(automaton, curr_node->left)->right = new_ref;
+        }
+        curr_node->left = new_ref; 
+    } else {
+        new_node->left = get_ref(automaton, curr_node); 
+        new_node->right = curr_node->right; 
+        if (curr_node->right) {
+            get_node(automaton, curr_node->right)->left = new_ref;
+        }
+        curr_node->right = new_ref; 
+    }
+}
+
+/* Radix construction functions **********************************************/
+/* Build automaton using input statements in stage 0, merging unary chains as 
+they form, so that it is as compressed as any number of compression leaves 
+it. Totals still count every state until automaton is next compressed. Freq 
+of merged nodes is kept, to be dropped unless statements are to be appended */
+automaton_t *construct_radix(reader_t *reader, writer_t *writer) {
+    automaton_t *automaton = get_new_automaton();
+    automaton->radix = get_new_radix();
+    int end, len;
+    char *line;
+    while ((end = get_line(reader, &line, &len)) != STAGE_END) {
+        /* Input must not end within stage 0 */
+        if (end != STMNT_END) invalid_input(writer);
+        insert_radix(automaton, automaton->radix, line, len);
+    }
+    return automaton;
+}
+
+/* Insert a statement into a merged automaton. A list is reached through the 
+merged nodes above it, which the statement passes, ends within or leaves */
+void insert_radix(automaton_t *automaton, radix_t *radix, char *line, int len) {
+    total_t *total = automaton->total;
+    total->statement++;
+    total->freq++;
+    total->character += len;
+    if (!len) return;
+    if (!automaton->outputs->head) {
+        automaton->outputs->head = new_leaf(automaton, radix, line, len);
+        return;
+    }
+    ref_t parent = NIL, anchor = automaton->outputs->head;
+    int pos = 0;
+    while (TRUE) {
+        node_t *anchor_node = get_node(automaton, anchor);
+        char *str = get_str(automaton, anchor_node);
+        int merged = anchor_node->len - INT_ONE, rest = len - pos, same = 0;
+        while (same < merged && same < rest && line[pos + same] == str[same]) {
+            same++;
+        }
+        /* Every merged node passed counts once, one statement ends at not */
+        int passed = (same == rest) ? same - INT_ONE : same;
+        merged_t *chain = get_chain(radix, anchor);
+        for (int i = 0; i < passed; i++) chain[i].freq++;
+        total->freq += passed;
+        total->merged_freq += passed;
+        if (same == rest) {
+            chain[passed].ends++;
+            return;
+        }
+        if (same < merged) {
+            split_chain(automaton, radix, parent, anchor, same, 
+                        line + pos + same, rest - same);
+            return;
+        }
+        ref_t child = find_child(automaton, anchor_node, line[pos + merged]);
+        if (!child) {
+            add_branch(automaton, radix, anchor, line + pos, merged, 
+                       line + pos + merged, rest - merged);
+            return;
+        }
+        pos += merged + INT_ONE;
+        node_t *node = get_node(automaton, child);
+        if (pos == len) {
+            node->ends++;
+            return;
+        }
+        if (!node->down) {
+            extend_leaf(automaton, radix, anchor, child, line + pos, 
+                        len - pos);
+            return;
+        }
+        node->freq++;
+        total->freq++;
+        update_best(automaton, anchor_node, node);
+        parent = child;
+        anchor = node->down;
+    }
+}
+
+/* Create a lone leaf labelled with chars, where a statement ends, merging the 
+len - 1 nodes a chain of them would have above it, each passed once */
+ref_t new_leaf(automaton_t *automaton, radix_t *radix, const char *chars, 
+               int len) {
+    node_t *leaf = get_new_node(automaton);
+    ref_t ref = get_ref(automaton, leaf);
+    set_label(automaton, leaf, chars, len);
+    leaf->ends = INT_ONE;
+    if (len > INT_ONE) {
+        merged_t *chain = (merged_t *)malloc((len - INT_ONE) * 
+                                             sizeof(merged_t));
+        assert(chain);
+        for (int i = 0; i < len - INT_ONE; i++) {
+            chain[i] = (merged_t){INT_ONE, INT_ZER};
+        }
+        set_chain(radix, ref, chain);
+    }
+    total_t *total = automaton->total;
+    total->state += len;
+    total->freq += len - INT_ONE;
+    total->merged_state += len - INT_ONE;
+    total->merged_freq += len - INT_ONE;
+    return ref;
+}
+
+/* Add a sibling labelled with len characters of prefix and the first one of 
+rest, with the remaining characters of rest merged into a leaf below it */
+void add_branch(automaton_t *automaton, radix_t *radix, ref_t anchor, 
+                const char *prefix, int len, const char *rest, int rest_len) {
+    char *chars = get_room(radix, len + INT_ONE);
+    memmove(chars, prefix, len);
+    chars[len] = rest[INT_ZER];
+    node_t *node = get_new_node(automaton);
+    ref_t ref = get_ref(automaton, node);
+    set_label(automaton, node, chars, len + INT_ONE);
+    automaton->total->state++;
+    if (rest_len > INT_ONE) {
+        ref_t down = new_leaf(automaton, radix, rest + INT_ONE, 
+                              rest_len - INT_ONE);
+        node = get_node(automaton, ref);
+        node->down = down;
+        node->freq = INT_ONE;
+        automaton->total->freq++;
+    } else {
+        node->ends = INT_ONE;
+    }
+    insert_sibling(automaton, get_node(automaton, anchor), node);
+}
+
+/* Split merged nodes above a list where a statement leaves them after len 
+characters. The merged node after those comes back as lone node of a new list 
+in place of the old one, and the statement branches off beside it */
+void split_chain(automaton_t *automaton, radix_t *radix, ref_t parent, 
+                 ref_t anchor, int len, const char *rest, int rest_len) {
+    node_t *anchor_node = get_node(automaton, anchor);
+    int merged = anchor_node->len - INT_ONE;
+    merged_t *chain = get_chain(radix, anchor);
+    char *chars = get_room(radix, anchor_node->len);
+    memcpy(chars, get_str(automaton, anchor_node), len + INT_ONE);
+    node_t *node = get_new_node(automaton);
+    ref_t ref = get_ref(automaton, node);
+    set_label(automaton, node, chars, len + INT_ONE);
+    node->freq = chain[len].freq;
+    node->ends = chain[len].ends;
+    node->down = anchor;
+    automaton->total->merged_state--;
+    automaton->total->merged_freq -= chain[len].freq;
+
+    /* Merged nodes above it move to the new list, ones below it stay */
+    merged_t *above = NULL, *below = NULL;
+    if (len) {
+        above = (merged_t *)malloc(len * sizeof(merged_t));
+        assert(above);
+        memcpy(above, chain, len * sizeof(merged_t));
+    }
+    if (merged > len + INT_ONE) {
+        below = (merged_t *)malloc((merged - len - INT_ONE) * 
+                                   sizeof(merged_t));
+        assert(below);
+        memcpy(below, chain + len + INT_ONE, 
+               (merged - len - INT_ONE) * sizeof(merged_t));
+    }
+    free(chain);
+    set_chain(radix, ref, above);
+    set_chain(radix, anchor, below);
+
+    /* Every sibling of old list loses the characters now above it */
+    node_t *curr = get_node(automaton, anchor);
+    while (curr->left) curr = get_node(automaton, curr->left);
+    for (; curr; curr = get_node(automaton, curr->right)) {
+        uint32_t curr_len = curr->len - len - INT_ONE;
+        memcpy(chars, get_str(automaton, curr) + len + INT_ONE, curr_len);
+        set_label(automaton, curr, chars, curr_len);
+    }
+    if (parent) {
+        get_node(automaton, parent)->down = ref;
+    } else {
+        automaton->outputs->head = ref;
+    }
+    node = get_node(automaton, ref);
+    add_branch(automaton, radix, ref, get_str(automaton, node), len, 
+               rest, rest_len);
+}
+
+/* Extend a leaf by rest of a statement. A leaf alone in its list merges with 
+what would be below it into a longer label, otherwise rest goes below it */
+void extend_leaf(automaton_t *automaton, radix_t *radix, ref_t anchor, 
+                 ref_t leaf, const char *rest, int rest_len) {
+    node_t *node = get_node(automaton, leaf);
+    if (anchor != leaf || node->left || node->right) {
+        ref_t down = new_leaf(automaton, radix, rest, rest_len);
+        get_node(automaton, leaf)->down = down;
+        return;
+    }
+    uint32_t len = node->len;
+    char *chars = get_room(radix, len + rest_len);
+    memcpy(chars, get_str(automaton, node), len);
+    memcpy(chars + len, rest, rest_len);
+    set_label(automaton, node, chars, len + rest_len);
+    /* Leaf was never counted as passed, nodes below it are passed once */
+    merged_t *chain = (merged_t *)realloc(get_chain(radix, leaf), 
+                                (len + rest_len - INT_ONE) * sizeof(merged_t));
+    assert(chain);
+    chain[len - INT_ONE] = (merged_t){node->freq, node->ends};
+    for (uint32_t i = len; i < len + rest_len - INT_ONE; i++) {
+        chain[i] = (merged_t){INT_ONE, INT_ZER};
+    }
+    set_chain(radix, leaf, chain);
+    total_t *total = automaton->total;
+    total->state += rest_len;
+    total->freq += rest_len - INT_ONE;
+    total->merged_state += rest_len;
+    total->merged_freq += node->freq + rest_len - INT_ONE;
+    node->freq = INT_ZER;
+    node->ends = INT_ONE;
+}
+
+/* Replace label of a node by len characters, which must lie outside arena */
+void set_label(automaton_t *automaton, node_t *node, const char *chars, 
+               uint32_t len) {
+    free_str(automaton, node);
+    if (len > INLINE_MAX) {
+        uint32_t str = get_new_str(automaton, len);
+        memcpy(automaton->memory->chars + str, chars, len);
+        node->str = str;
+    } else {
+        memcpy(node->chars, chars, len);
+    }
+    node->len = len;
+}
+
+/* Get merged nodes above a list, NULL if there is none */
+merged_t *get_chain(radix_t *radix, ref_t anchor) {
+    return anchor < radix->max ? radix->chains[anchor] : NULL;
+}
+
+/* Keep merged nodes above a list, replacing without freeing */
+void set_chain(radix_t *radix, ref_t anchor, merged_t *chain) {
+    if (anchor >= radix->max) {
+        uint32_t max = radix->max ? radix->max : INIT_SLOTS;
+        while (anchor >= max) max *= INT_TWO;
+        radix->chains = (merged_t **)realloc(radix->chains, 
+                                             max * sizeof(merged_t *));
+        assert(radix->chains);
+        memset(radix->chains + radix->max, 0, 
+               (max - radix->max) * sizeof(merged_t *));
+        radix->max = max;
+    }
+    radix->chains[anchor] = chain;
+}
+
+/* Get room to assemble a label of len characters */
+char *get_room(radix_t *radix, uint32_t len) {
+    if (len > radix->max_chars) {
+        uint32_t max = radix->max_chars ? radix->max_chars : INIT_CHARS;
+        while (len > max) max *= INT_TWO;
+        radix->chars = (char *)realloc(radix->chars, max);
+        assert(radix->chars);
+        radix->max_chars = max;
+    }
+    return radix->chars;
+}
+
+/* Keep y node with merged nodes above its list, ahead of those above list of 
+z below it, as y merges into that list. Chain above grows in place to a power 
+of two, so merging a long chain top down stays linear */
+void join_chains(radix_t *radix, ref_t y, ref_t z, uint32_t above, 
+                 uint32_t below, merged_t merged) {
+    uint32_t len = above + INT_ONE + below, max = INT_ONE;
+    while (max < len) max *= INT_TWO;
+    merged_t *chain = (merged_t *)realloc(get_chain(radix, y), 
+                                          max * sizeof(merged_t));
+    assert(chain);
+    chain[above] = merged;
+    if (below) {
+        memcpy(chain + above + INT_ONE, get_chain(radix, z), 
+               below * sizeof(merged_t));
+    }
+    free(get_chain(radix, z));
+    set_chain(radix, y, NULL);
+    set_chain(radix, z, chain);
+}
+
+/* Incremental training functions ********************************************/
+/* Start or stop keeping freq of merged nodes, which appending statements 
+needs. Keeping can only start before automaton is first compressed */
+void keep_merged(automaton_t *automaton, int keep) {
+    if (keep && !automaton->radix) {
+        assert(!automaton->version);
+        automaton->radix = get_new_radix();
+    } else if (!keep && automaton->radix) {
+        free_radix(automaton->radix);
+        automaton->radix = NULL;
+    }
+}
+
+/* Append statements to an automaton that keeps freq of its merged nodes, 
+one a line up to an empty line or end of input. They come in merged as any 
+number of compression would leave them, and split merged nodes they leave 
+partway, so that automaton is as if built from them too and compressed 
+again. Returns number of statements appended */
+int append_statements(automaton_t *automaton, reader_t *reader, 
+                      writer_t *writer) {
+    assert(automaton && automaton->radix && !automaton->frozen);
+    /* A mapped snapshot is copied out before it is changed */
+    if (automaton->memory->map) thaw_memory(automaton->memory);
+    int end, len, num = 0;
+    char *line;
+    reader->stage_num = STAGE_2;
+    while ((end = get_line(reader, &line, &len)) == STMNT_END || 
+           (end == EOF && len)) {
+        insert_radix(automaton, automaton->radix, line, len);
+        num++;
+    }
+    if (end == BAD_END) invalid_input(writer);
+    /* Text cached so far no longer holds, nor does latest statement's path */
+    clear_memo(automaton->memo);
+    automaton->version++;
+    automaton->path->len = INT_ZER;
+    /* Merged states are counted out as any number of compression would */
+    count_merged(automaton, INT32_MAX);
+    return num;
+}
+
+/* Append statements of a file, see append_statements */
+int append_file(automaton_t *automaton, char *path, writer_t *writer) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Statements %s: %s, program terminated\n", path, 
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    reader_t *reader = get_new_reader(fp);
+    int num = append_statements(automaton, reader, writer);
+    free_reader(reader);
+    fclose(fp);
+    return num;
+}
+
+/* Printing functions ********************************************************/
+/* Process first-half of stages 1 and 2 input prompts and print to STDOUT */
+void print_prefix(automaton_t *automaton, query_t *query, writer_t *writer, 
+                  char c, int *char_count, int *first_input, int *terminate, 
+                  int *index) {
+    node_t *curr_node, *tail = get_node(automaton, query->tail);
+    put_char(writer, c);
+    (*char_count)++;
+
+    /* Reset curr_node to head for every new input prompt */
+    if (*first_input) {
+        curr_node = get_node(automaton, automaton->outputs->head);
+        *first_input = FALSE;
+        *index = 0;
+        query->str_len = curr_node->len;
+    } else {
+        /* If leaf node is reached, terminate the searching */
+        if (!tail->down && *index >= (int)tail->len) {   
+            *terminate = TRUE;
+            *index = query->str_len = 0;
+            print_ellipses(writer, char_count);
+            put_char(writer, NEWLIN);
+            return;
+        /* If the entire transition string has been searched, reassign tail */
+        } else if (*index >= query->str_len) {
+            curr_node = get_node(automaton, tail->down);
+            query->str_len = curr_node->len;
+            *index = 0;
+        /* Otherwise, search through the same string of previous node */
+        } else {
+            curr_node = tail;
+        }
+    }
+    /* Handle unmatched character */
+    if (!find_matching_char(automaton, query, curr_node, c, index)) {
+        *terminate = TRUE;
+        print_ellipses(writer, char_count);
+        put_char(writer, NEWLIN);
+    }
+}
+
+/* Compare character using string indexing then search for same left or right */
+int find_matching_char(automaton_t *automaton, query_t *query, node_t *curr, 
+                       char c, int *index) {
+    int fixed = FALSE;
+    /* An anchor jumps straight to the sibling keyed by character */
+    if (curr->lookup && c != get_str(automaton, curr)[*index]) {
+        curr = get_node(automaton, find_child(automaton, curr, c));
+        if (!curr || c != get_str(automaton, curr)[*index]) return FALSE;
+    }
+    while (curr) {
+        char curr_c = get_str(automaton, curr)[*index];
+        /* If character matches, record its index */
+        if (c == curr_c) {
+            query->tail = get_ref(automaton, curr);
+            (*index)++;
+            return TRUE;           
+        /* Otherwise, loop through one side only (fixed) */
+        } else if (c < curr_c && !fixed) {
+            fixed = LEFT;
+        } else if (c > curr_c && !fixed) {
+            fixed = RIGHT;
+        }
+        if (fixed == LEFT) curr = get_node(automaton, curr->left);
+        if (fixed == RIGHT) curr = get_node(automaton, curr->right);
+        COUNT(&query->stats, CNT_MATCH_HOPS, INT_ONE);
+    } 
+    return FALSE;
+}
+
+/* Process second-half of stages 1 and 2 input prompts and print to STDOUT */
+void print_suffix(automaton_t *automaton, query_t *query, writer_t *writer, 
+                  int *char_count, int *index) {
+    assert(automaton);
+    print_ellipses(writer, char_count);
+
+    /* If string of node pointed by tail was not printed out completely, 
+    finish string of best node in the same list first */
+    node_t *tail = get_node(automaton, query->tail);
+    if (*index < (int)tail->len) {
+        ref_t *best = get_best(automaton, tail);
+        if (best) tail = get_node(automaton, *best);
+        query->tail = get_ref(automaton, tail);
+        print_char(automaton, writer, tail, char_count, *index);
+    }
+    /* Then copy out cached text generated below that node */
+    completion_t *completion = get_completion(automaton, query->memo, 
+                                              query->tail);
+    int len = OUTPUT_MAX - *char_count;
+    if (completion->len < len) len = completion->len;
+    put_chars(writer, completion->text, len);
+    *char_count += len;
+    put_char(writer, NEWLIN);
+}
+
+/* Find text generated below a node, following nodes of higher freq or higher 
+ASCII if equal. Text is generated and cached on first request */
+completion_t *get_completion(automaton_t *automaton, memo_t *memo, 
+                             ref_t ref) {
+    completion_t *set = get_memo_set(memo, ref), *victim = set;
+    memo->clock++;
+    for (int i = 0; i < MEMO_WAYS; i++) {
+        if (set[i].used && set[i].node == ref) {
+            set[i].used = memo->clock;
+            return &set[i];
+        }
+        if (set[i].used < victim->used) victim = &set[i];
+    }
+    /* Evict least recently used completion of the set */
+    victim->node = ref;
+    victim->used = memo->clock;
+    victim->len = INT_ZER;
+    frozen_t *frozen = automaton->frozen;
+    if (frozen) {
+        cell_t *cells = frozen->cells;
+        uint32_t node = ref;
+        while (victim->len < OUTPUT_MAX && cells[node].count) {
+            uint32_t next = cells[node].first + cells[node].best;
+            victim->len += copy_label(frozen, node, next, INT_ZER, 
+                                      victim->text + victim->len, 
+                                      OUTPUT_MAX - victim->len);
+            node = next;
+        }
+        return victim;
+    }
+    node_t *curr_node = get_node(automaton, get_node(automaton, ref)->down);
+    while (victim->len < OUTPUT_MAX && curr_node) {
+        ref_t *best = get_best(automaton, curr_node);
+        if (best) curr_node = get_node(automaton, *best);
+        int len = OUTPUT_MAX - victim->len;
+        if ((int)curr_node->len < len) len = curr_node->len;
+        memcpy(victim->text + victim->len, get_str(automaton, curr_node), len);
+        victim->len += len;
+        curr_node = get_node(automaton, curr_node->down);
+    }
+    return victim;
+}
+
+/* Find set of cached completions a node belongs to */
+completion_t *get_memo_set(memo_t *memo, ref_t node) {
+    uint32_t hash = node * 2654435761u;
+    return memo->slots + (hash & (memo->num_sets - INT_ONE)) * MEMO_WAYS;
+}
+
+/* Drop cached text of a node that no longer exists */
+void forget_completion(automaton_t *automaton, ref_t node) {
+    completion_t *set = get_memo_set(automaton->memo, node);
+    for (int i = 0; i < MEMO_WAYS; i++) {
+        if (set[i].used && set[i].node == node) set[i].used = INT_ZER;
+    }
+}
+
+/* print ellipses under 37 character limit*/
+void print_ellipses(writer_t *writer, int *char_count) {
+    for (int i = 0; *char_count < OUTPUT_MAX && i < INT_THR; i++, 
+         (*char_count)++) {
+        put_char(writer, ELLIPSE);
+    }
+}
+
+/* print characters under 37 character limit */
+void print_char(automaton_t *automaton, writer_t *writer, node_t *node, 
+                int *char_count, int index) {
+    int len = OUTPUT_MAX - *char_count;
+    if ((int)node->len - index < len) len = node->len - index;
+    if (len <= 0) return;
+    put_chars(writer, get_str(automaton, node) + index, len);
+    *char_count += len;
+}
+
+/* Ranking functions *********************************************************/
+/* Rank siblings of every list of automaton, unless ranked since it was last 
+changed. Lists are laid out depth first, so going back over them ranks every 
+list below a sibling before the sibling's own. A frozen automaton keeps no 
+freq to rank by */
+void rank_automaton(automaton_t *automaton) {
+    ranks_t *ranks = automaton->ranks;
+    if (automaton->frozen || (ranks && ranks->version == automaton->version)) {
+        return;
+    }
+    if (!ranks) {
+        ranks = automaton->ranks = (ranks_t *)calloc(INT_ONE, sizeof(*ranks));
+        assert(ranks);
+    }
+    uint32_t max = automaton->memory->nodes.num, num = INT_ZER;
+    ranks->ranks = (rank_t *)realloc(ranks->ranks, max * sizeof(rank_t));
+    ranks->runs = (run_t *)realloc(ranks->runs, max * sizeof(run_t));
+    assert(ranks->ranks && ranks->runs);
+    ranks->version = automaton->version;
+
+    /* Lay out list below each node taken off worklist, NIL standing above 
+    root list */
+    worklist_t worklist = {NULL, INT_ZER, INT_ZER};
+    push_node(&worklist, NIL);
+    while (worklist.num) {
+        node_t *above = get_node(automaton, worklist.refs[--worklist.num]);
+        node_t *node = get_node(automaton, above ? above->down : 
+                                           automaton->outputs->head);
+        if (!node) continue;
+        rank_t *ranked = ranks->ranks + num;
+        uint32_t count = 0;
+        while (node->left) node = get_node(automaton, node->left);
+        for (; node; node = get_node(automaton, node->right)) {
+            ranked[count++] = (rank_t){get_ref(automaton, node), node->ends};
+            if (node->down) push_node(&worklist, get_ref(automaton, node));
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            ranks->runs[ranked[i].node] = (run_t){num, count};
+        }
+        num += count;
+    }
+    free(worklist.refs);
+
+    /* Rank lists from last laid out, a sibling taking freq of list below */
+    char keys[ASCII_MAX];
+    while (num) {
+        run_t run = ranks->runs[ranks->ranks[num - INT_ONE].node];
+        rank_t *ranked = ranks->ranks + run.first;
+        for (uint32_t i = 0; i < run.count; i++) {
+            rank_t rank = ranked[i];
+            node_t *node = get_node(automaton, rank.node);
+            if (node->down) {
+                run_t below = ranks->runs[node->down];
+                if (ranks->ranks[below.first].freq > rank.freq) {
+                    rank.freq = ranks->ranks[below.first].freq;
+                }
+            }
+            char key = get_key(automaton, node);
+            uint32_t j = i;
+            for (; j > 0 && (ranked[j - INT_ONE].freq < rank.freq || 
+                 (ranked[j - INT_ONE].freq == rank.freq && 
+                  keys[j - INT_ONE] < key)); j--) {
+                ranked[j] = ranked[j - INT_ONE];
+                keys[j] = keys[j - INT_ONE];
+            }
+            ranked[j] = rank;
+            keys[j] = key;
+        }
+        num = run.first;
+    }
+}
+
+/* Free siblings ranked */
+void free_ranks(ranks_t *ranks) {
+    free(ranks->ranks);
+    free(ranks->runs);
+    free(ranks);
+}
+
+/* Find up to k completions below where a prompt matched, up to room 
+characters each, in order of freq. Completion i goes to texts + i * 
+OUTPUT_MAX and its length to lens[i]. Returns number of completions */
+int rank_completions(automaton_t *automaton, query_t *query, int index, 
+                     int room, int k, char *texts, int *lens) {
+    if (!query->ranking) query->ranking = get_new_ranking();
+    ranking_t *ranking = query->ranking;
+    rank_t *ranks = automaton->ranks->ranks;
+    ranking->num_lists = ranking->num = INT_ZER;
+    /* A prompt ending within a string goes on with any sibling, one ending 
+    a leaf has nothing to go on with */
+    node_t *tail = get_node(automaton, query->tail);
+    if (!room || (index >= (int)tail->len && !tail->down)) {
+        lens[INT_ZER] = INT_ZER;
+        return INT_ONE;
+    }
+    if (index < (int)tail->len) {
+        rank_list(automaton, ranking, query->tail, NO_LIST, INT_ZER, INT_ZER, 
+                  index);
+    } else {
+        /* Prompt may itself be a statement, completed by nothing */
+        if (tail->ends) {
+            push_branch(ranking, (branch_t){tail->ends, INT_ZER, NO_LIST, 
+                        INT_ZER, TRUE});
+        }
+        rank_list(automaton, ranking, tail->down, NO_LIST, INT_ZER, INT_ZER, 
+                  INT_ZER);
+    }
+    int num = 0, taken = 0;
+    while (ranking->num && num < k) {
+        branch_t branch = pop_branch(ranking);
+        char *text = texts + num * OUTPUT_MAX;
+        if (branch.end) {
+            lens[num++] = copy_ranked(automaton, ranking, &branch, room, text);
+            continue;
+        }
+        reached_t *list = &ranking->lists[branch.list];
+        uint32_t rank = list->first + branch.pos;
+        node_t *node = get_node(automaton, ranks[rank].node);
+        int len = branch.len + (int)node->len - list->index;
+        /* Siblings part at their last character, past room they are alike */
+        if (branch.pos + INT_ONE < list->count && len <= room) {
+            push_branch(ranking, (branch_t){ranks[rank + INT_ONE].freq, 
+                        branch.len, branch.list, branch.pos + INT_ONE, FALSE});
+        }
+        if (node->down && len < room && taken++ < k * OUTPUT_MAX) {
+            if (node->ends) {
+                push_branch(ranking, (branch_t){node->ends, branch.len, 
+                            branch.list, branch.pos, TRUE});
+            }
+            rank_list(automaton, ranking, node->down, branch.list, 
+                      branch.pos, len, INT_ZER);
+            continue;
+        }
+        /* Completion ends here, or follows nodes of higher freq once 
+        branches taken run out */
+        len = copy_ranked(automaton, ranking, &branch, room, text);
+        if (len < room) {
+            completion_t *completion = get_completion(automaton, query->memo, 
+                                                      ranks[rank].node);
+            int n = room - len;
+            if (completion->len < n) n = completion->len;
+            memcpy(text + len, completion->text, n);
+            len += n;
+        }
+        lens[num++] = len;
+    }
+    return num;
+}
+
+/* Take list of a node as it is reached at len characters of a completion, 
+index characters into strings of its siblings, and its first sibling as a 
+branch */
+void rank_list(automaton_t *automaton, ranking_t *ranking, ref_t node, 
+               int above, int pos, int len, int index) {
+    if (ranking->num_lists == ranking->max_lists) {
+        ranking->max_lists = ranking->max_lists ? 
+                             ranking->max_lists * INT_TWO : INIT_SLOTS;
+        ranking->lists = (reached_t *)realloc(ranking->lists, 
+                                    ranking->max_lists * sizeof(reached_t));
+        assert(ranking->lists);
+    }
+    run_t run = automaton->ranks->runs[node];
+    ranking->lists[ranking->num_lists] = (reached_t){run.first, run.count, 
+                                                    above, pos, len, index};
+    push_branch(ranking, (branch_t){automaton->ranks->ranks[run.first].freq, 
+                len, ranking->num_lists++, INT_ZER, FALSE});
+}
+
+/* Copy characters of a completion up to the sibling of a branch, going up 
+lists reached, without exceeding room. Returns number of characters copied */
+int copy_ranked(automaton_t *automaton, ranking_t *ranking, branch_t *branch, 
+                int room, char *text) {
+    int list = branch->list, pos = branch->pos, len = INT_ZER;
+    while (list != NO_LIST) {
+        reached_t *reached = &ranking->lists[list];
+        rank_t *rank = &automaton->ranks->ranks[reached->first + pos];
+        node_t *node = get_node(automaton, rank->node);
+        int n = room - reached->len;
+        if ((int)node->len - reached->index < n) n = node->len - reached->index;
+        memcpy(text + reached->len, get_str(automaton, node) + reached->index, 
+               n);
+        if (reached->len + n > len) len = reached->len + n;
+        list = reached->above;
+        pos = reached->pos;
+    }
+    return len;
+}
+
+/* Add a branch to heap of branches left */
+void push_branch(ranking_t *ranking, branch_t branch) {
+    if (ranking->num == ranking->max) {
+        ranking->max = ranking->max ? ranking->max * INT_TWO : INIT_SLOTS;
+        ranking->heap = (branch_t *)realloc(ranking->heap, 
+                                            ranking->max * sizeof(branch_t));
+        assert(ranking->heap);
+    }
+    int i = ranking->num++;
+    while (i > 0 && is_better(&branch, &ranking->heap[(i - INT_ONE) / 
+                                                      INT_TWO])) {
+        ranking->heap[i] = ranking->heap[(i - INT_ONE) / INT_TWO];
+        i = (i - INT_ONE) / INT_TWO;
+    }
+    ranking->heap[i] = branch;
+}
+
+/* Take best branch off heap of branches left */
+branch_t pop_branch(ranking_t *ranking) {
+    branch_t best = ranking->heap[INT_ZER];
+    branch_t last = ranking->heap[--ranking->num];
+    int i = 0;
+    while (INT_TWO * i + INT_ONE < ranking->num) {
+        int child = INT_TWO * i + INT_ONE;
+        if (child + INT_ONE < ranking->num && 
+            is_better(&ranking->heap[child + INT_ONE], &ranking->heap[child])) {
+            child++;
+        }
+        if (!is_better(&ranking->heap[child], &last)) break;
+        ranking->heap[i] = ranking->heap[child];
+        i = child;
+    }
+    ranking->heap[i] = last;
+    return best;
+}
+
+/* Whether a branch goes before another, by freq. Of equal freq, one further 
+down goes first, so that a completion is finished before others are started */
+int is_better(branch_t *a, branch_t *b) {
+    if (a->freq != b->freq) return a->freq > b->freq;
+    if (a->len != b->len) return a->len > b->len;
+    return a->list < b->list;
+}
+
+/* Frozen automaton functions ************************************************/
+/* Lay automaton out into cells and release its nodes. A frozen automaton 
+answers prompts as before, but can no longer be compressed or saved */
+void freeze_automaton(automaton_t *automaton) {
+    assert(automaton && !automaton->frozen);
+    uint32_t max = automaton->memory->nodes.num, num = INT_ONE;
+    uint32_t num_chars = INT_ZER, max_chars = INIT_CHARS;
+    frozen_t *frozen = (frozen_t *)malloc(sizeof(*frozen));
+    assert(frozen);
+    frozen->cells = (cell_t *)malloc(max * sizeof(cell_t));
+    frozen->chars = (char *)malloc(max_chars);
+    assert(frozen->cells && frozen->chars);
+    memset(frozen->cells, 0, sizeof(cell_t));
+
+    /* Lay out list below each cell taken off worklist. Until then, first of 
+    a cell holds its node */
+    worklist_t worklist = {NULL, INT_ZER, INT_ZER};
+    ref_t list[ASCII_MAX];
+    char keys[ASCII_MAX];
+    push_node(&worklist, INT_ZER);
+    while (worklist.num) {
+        uint32_t i = worklist.refs[--worklist.num];
+        cell_t *cell = frozen->cells + i;
+        ref_t down = i ? get_node(automaton, cell->first)->down 
+                       : automaton->outputs->head;
+        if (!down) continue;
+        node_t *curr = get_node(automaton, down);
+        ref_t *best = get_best(automaton, curr);
+        ref_t best_ref = best ? *best : down;
+        cell->shared = num_chars;
+        cell->shared_len = curr->len - INT_ONE;
+        while (num_chars + cell->shared_len > max_chars) {
+            max_chars *= INT_TWO;
+            frozen->chars = (char *)realloc(frozen->chars, max_chars);
+            assert(frozen->chars);
+        }
+        memcpy(frozen->chars + num_chars, get_str(automaton, curr), 
+               cell->shared_len);
+        num_chars += cell->shared_len;
+
+        /* Siblings are sorted by key into cells */
+        int count = 0;
+        while (curr->left) curr = get_node(automaton, curr->left);
+        for (; curr; curr = get_node(automaton, curr->right)) {
+            char key = get_key(automaton, curr);
+            int j = count++;
+            for (; j > 0 && keys[j - INT_ONE] > key; j--) {
+                keys[j] = keys[j - INT_ONE];
+                list[j] = list[j - INT_ONE];
+            }
+            keys[j] = key;
+            list[j] = get_ref(automaton, curr);
+        }
+        cell->first = num;
+        cell->count = count;
+        for (int j = 0; j < count; j++) {
+            cell_t *child = frozen->cells + num + j;
+            memset(child, 0, sizeof(*child));
+            child->key = keys[j];
+            if (get_node(automaton, list[j])->down) child->first = list[j];
+            if (list[j] == best_ref) cell->best = j;
+        }
+        /* Cell to follow is taken next, so its list comes right after */
+        for (int j = count - INT_ONE; j >= 0; j--) {
+            if (j != cell->best && frozen->cells[num + j].first) {
+                push_node(&worklist, num + j);
+            }
+        }
+        if (frozen->cells[num + cell->best].first) {
+            push_node(&worklist, num + cell->best);
+        }
+        num += count;
+    }
+    free(worklist.refs);
+    frozen->num = num;
+    frozen->cells = (cell_t *)realloc(frozen->cells, num * sizeof(cell_t));
+    assert(frozen->cells);
+    release_nodes(automaton->memory);
+    memset(automaton->memory, 0, sizeof(*automaton->memory));
+
+    /* Cached text refers to nodes by index, which changed */
+    memset(automaton->memo->slots, 0, automaton->memo->num_sets * MEMO_WAYS * 
+           sizeof(completion_t));
+    automaton->version++;
+    automaton->frozen = frozen;
+}
+
+/* Print a prompt followed by text generated from it, walking a frozen 
+automaton the same way print_prefix and print_suffix walk nodes */
+void answer_frozen(automaton_t *automaton, query_t *query, writer_t *writer, 
+                   const char *line, int len, int end) {
+    cell_t *cells = automaton->frozen->cells;
+    uint32_t parent = INT_ZER, node = NIL;
+    int char_count = resume_prompt(query, writer, line, len), index = 0;
+    if (char_count) {
+        cursor_t *cursor = &query->trail->cursors[char_count - INT_ONE];
+        node = cursor->tail;
+        parent = cursor->parent;
+        index = cursor->index;
+    }
+    for (int i = char_count; i < len && char_count < OUTPUT_MAX; i++) {
+        put_char(writer, line[i]);
+        char_count++;
+        /* Once a label is matched, move to list below unless it is a leaf */
+        int leaf = FALSE;
+        if (index > (int)cells[parent].shared_len) {
+            leaf = !cells[node].count;
+            parent = node;
+            node = NIL;
+            index = 0;
+        }
+        if (leaf || !match_frozen(automaton->frozen, parent, &node, line[i], 
+                                  index++)) {
+            print_ellipses(writer, &char_count);
+            put_char(writer, NEWLIN);
+            return;
+        }
+        if (query->trail) {
+            keep_cursor(query->trail, i, line[i], 
+                        (cursor_t){node, parent, INT_ZER, index});
+        }
+    }
+    if (!len || end == BAD_END) return;
+    print_ellipses(writer, &char_count);
+    /* Finish label of best cell in the same list first */
+    if (index <= (int)cells[parent].shared_len) {
+        char text[OUTPUT_MAX];
+        node = cells[parent].first + cells[parent].best;
+        int copied = copy_label(automaton->frozen, parent, node, index, text, 
+                                OUTPUT_MAX - char_count);
+        put_chars(writer, text, copied);
+        char_count += copied;
+    }
+    /* Then copy out cached text generated below that cell */
+    completion_t *completion = get_completion(automaton, query->memo, node);
+    int copied = OUTPUT_MAX - char_count;
+    if (completion->len < copied) copied = completion->len;
+    put_chars(writer, completion->text, copied);
+    put_char(writer, NEWLIN);
+}
+
+/* Match a character at index of labels in list below parent, where node is 
+set once the last character, which tells siblings apart, is matched */
+int match_frozen(frozen_t *frozen, uint32_t parent, uint32_t *node, char c, 
+                 int index) {
+    cell_t *cell = frozen->cells + parent;
+    if (index < (int)cell->shared_len) {
+        return c == frozen->chars[cell->shared + index];
+    }
+    int lo = 0, hi = cell->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / INT_TWO;
+        char key = frozen->cells[cell->first + mid].key;
+        if (key == c) {
+            *node = cell->first + mid;
+            return TRUE;
+        }
+        if (key < c) lo = mid + INT_ONE;
+        else hi = mid;
+    }
+    return FALSE;
+}
+
+/* Copy label of a cell in list below parent from index on into text, up to 
+max characters. Returns number of characters copied */
+int copy_label(frozen_t *frozen, uint32_t parent, uint32_t node, int index, 
+               char *text, int max) {
+    cell_t *cell = frozen->cells + parent;
+    int shared = cell->shared_len, len = shared + INT_ONE - index;
+    if (len > max) len = max;
+    if (len <= 0) return INT_ZER;
+    if (len > shared - index) {
+        memcpy(text, frozen->chars + cell->shared + index, len - INT_ONE);
+        text[len - INT_ONE] = frozen->cells[node].key;
+    } else {
+        memcpy(text, frozen->chars + cell->shared + index, len);
+    }
+    return len;
+}
+
+/* Check functions ***********************************************************/
+/* Run built-in checks, reporting any that fail to stderr. Returns number of 
+checks failed */
+int run_checks(void) {
+    /* Ranked completions follow statements ending below, greedy one follows 
+    statements going past, and all leaves have none going past */
+    check_t checks[] = {
+        {"abc\nabc\nabc\nabd\nabd\n", "ab", INT_TWO, "ab...c\nab...d"}, 
+        {"abc\nabc\nabc\nabd\nabd\nabx\n", "ab", INT_ONE, "ab...c"}, 
+        {"abc\nabc\nabc\nabd\nabd\nabx\n", "ab", INT_ZER, "ab...x"}
+    };
+    int num = sizeof(checks) / sizeof(checks[0]), failed = 0;
+    for (int i = 0; i < num; i++) failed += !run_check(&checks[i]);
+    failed += !check_lookups();
+    printf("Checks passed: %d of %d\n", num + INT_ONE - failed, 
+           num + INT_ONE);
+    return failed;
+}
+
+/* Build automaton of a check and compare lines its prompt gets to those 
+expected. Returns TRUE if they are the same */
+int run_check(const check_t *check) {
+    automaton_t *automaton = build_automaton(check->statements, 
+                                             strlen(check->statements), 
+                                             INT_ONE);
+    assert(automaton);
+    query_t *query = get_new_query(automaton);
+    char lines[TOP_MAX * OUTPUT_LINE], got[TOP_MAX * OUTPUT_LINE];
+    int len = strlen(check->prompt), num = INT_ONE;
+    if (check->top_k) {
+        num = complete_top_k(automaton, query, check->prompt, len, 
+                             check->top_k, lines);
+    } else {
+        complete_prompt(automaton, query, check->prompt, len, lines);
+    }
+    /* Lines are joined a line each, as expected ones are */
+    int n = 0;
+    for (int i = 0; i < num; i++) {
+        n += sprintf(got + n, i ? "\n%s" : "%s", lines + i * OUTPUT_LINE);
+    }
+    free_query(query);
+    free_automaton(automaton);
+    if (!strcmp(got, check->lines)) return TRUE;
+    fprintf(stderr, "Check of prompt %s with -n %d failed, got:\n%s\n"
+            "instead of:\n%s\n", check->prompt, check->top_k, got, 
+            check->lines);
+    return FALSE;
+}
+
+/* Check search of small lookups finds what scalar search does for every 
+count of keys spread at several steps, with stale keys past count. Returns 
+TRUE if it does */
+int check_lookups(void) {
+    char keys[SMALL_MAX];
+    for (int step = INT_ONE; step <= CHECK_STEPS; step++) {
+        for (uint32_t count = 0; count <= SMALL_MAX; count++) {
+            for (uint32_t i = 0; i < SMALL_MAX; i++) {
+                keys[i] = i < count ? PRINTABLE_MIN + i * step : 
+                                      ASCII_MAX - INT_ONE;
+            }
+            for (int key = 0; key < ASCII_MAX; key++) {
+                if (find_key(keys, count, key) == 
+                    find_key_scalar(keys, count, key) && 
+                    find_above(keys, count, key) == 
+                    find_above_scalar(keys, count, key)) continue;
+                fprintf(stderr, "Check of small lookups failed for key %d "
+                        "among %u keys\n", key, count);
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+/* Benchmark functions *******************************************************/
+/* Read shape of a corpus from comma separated numbers in the order of 
+corpus_t, leaving out any from the end takes their defaults */
+corpus_t get_corpus(char *spec) {
+    corpus_t corpus = {GEN_STATEMENTS, GEN_MAX_LEN, GEN_ALPHABET, GEN_SHARE, 
+                       GEN_COMPRESS, GEN_PROMPTS, INT_ONE};
+    unsigned long long seed = corpus.seed;
+    sscanf(spec, "%d,%d,%d,%d,%d,%d,%llu", &corpus.statements, 
+           &corpus.max_len, &corpus.alphabet, &corpus.share, 
+           &corpus.num_compress, &corpus.prompts, &seed);
+    corpus.seed = seed ? seed : INT_ONE;
+    if (corpus.statements < 0) corpus.statements = INT_ZER;
+    if (corpus.max_len < INT_ONE) corpus.max_len = INT_ONE;
+    if (corpus.alphabet < INT_ONE) corpus.alphabet = INT_ONE;
+    if (corpus.alphabet > PRINTABLE_NUM) corpus.alphabet = PRINTABLE_NUM;
+    if (corpus.share < 0) corpus.share = INT_ZER;
+    if (corpus.prompts < 0) corpus.prompts = INT_ZER;
+    return corpus;
+}
+
+/* Print an input of all stages in the shape of a corpus */
+void generate_corpus(corpus_t *corpus, writer_t *writer) {
+    batch_t *statements = get_new_batch();
+    char *line = (char *)malloc(corpus->max_len);
+    assert(line);
+    uint64_t state = corpus->seed;
+    for (int i = 0; i < corpus->statements; i++) {
+        int len = INT_ONE + get_random(&state, corpus->max_len), same = 0;
+        /* Start with first characters of an earlier statement */
+        if (statements->num && 
+            (int)get_random(&state, PERCENT) < corpus->share) {
+            int j = get_random(&state, statements->num);
+            same = get_random(&state, statements->lens[j] + INT_ONE);
+            if (same > len) same = len;
+            memcpy(line, statements->chars + statements->starts[j], same);
+        }
+        for (int k = same; k < len; k++) {
+            line[k] = get_random_char(corpus, &state);
+        }
+        add_line(statements, line, len);
+        put_chars(writer, line, len);
+        put_char(writer, NEWLIN);
+    }
+    put_char(writer, NEWLIN);
+    generate_prompts(corpus, statements, line, &state, writer);
+    put_char(writer, NEWLIN);
+    put_format(writer, "%d\n", corpus->num_compress);
+    generate_prompts(corpus, statements, line, &state, writer);
+    free(line);
+    free_batch(statements);
+}
+
+/* Print prompts of a stage, most of them first characters of a statement */
+void generate_prompts(corpus_t *corpus, batch_t *statements, char *line, 
+                      uint64_t *state, writer_t *writer) {
+    for (int i = 0; i < corpus->prompts; i++) {
+        int len;
+        if (statements->num && 
+            (int)get_random(state, PERCENT) < PROMPT_SHARE) {
+            int j = get_random(state, statements->num);
+            len = INT_ONE + get_random(state, statements->lens[j]);
+            memcpy(line, statements->chars + statements->starts[j], len);
+        } else {
+            len = INT_ONE + get_random(state, corpus->max_len);
+            for (int k = 0; k < len; k++) {
+                line[k] = get_random_char(corpus, state);
+            }
+        }
+        put_chars(writer, line, len);
+        put_char(writer, NEWLIN);
+    }
+}
+
+/* Draw one of the alphabet characters of a corpus, starting from 'a' and 
+wrapping around printable characters */
+char get_random_char(corpus_t *corpus, uint64_t *state) {
+    return PRINTABLE_MIN + ('a' - PRINTABLE_MIN + 
+                            get_random(state, corpus->alphabet)) % 
+                           PRINTABLE_NUM;
+}
+
+/* Draw a number below range from a xorshift generator, which gives the same 
+numbers for the same seed on every platform */
+uint32_t get_random(uint64_t *state, uint32_t range) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (uint32_t)((*state * 2685821657736338717ull) >> 32) % range;
+}
+
+/* Time scalar and SSE2 searches of small lookups of automaton for every 
+printable character, both must find the same siblings */
+void time_lookups(automaton_t *automaton, stopwatch_t *watch) {
+    pool_t *pool = &automaton->memory->smalls;
+    uint32_t num = pool->num < BENCH_LOOKUPS ? pool->num : BENCH_LOOKUPS;
+    long probes = INT_ZER, found = INT_ZER;
+    start_phase(watch);
+    /* Released lookups keep their keys, only best links them */
+    for (uint32_t i = INT_ONE; i < num; i++) {
+        small_t *small = (small_t *)pool->slots + i;
+        if (small->count > SMALL_MAX) continue;
+        for (char key = PRINTABLE_MIN; 
+             key < PRINTABLE_MIN + PRINTABLE_NUM; key++) {
+            found += find_key_scalar(small->keys, small->count, key) + 
+                     find_above_scalar(small->keys, small->count, key);
+            probes++;
+        }
     }
-    /* Keep track of stage changes based on input file format */
-    if (c == NEWLIN && previously_newline) {
-        stage_num++;
-        return STAGE_END;
-    } else if (c == NEWLIN) {
-        previously_newline = TRUE;
-        return STMNT_END;
-    } else {
-        previously_newline = FALSE;
+    end_phase(watch, "find_scalar", probes, "probes");
+#ifdef SIMD_LOOKUP
+    if (!HAS_SSE2) return;
+    long found_sse2 = INT_ZER;
+    start_phase(watch);
+    for (uint32_t i = INT_ONE; i < num; i++) {
+        small_t *small = (small_t *)pool->slots + i;
+        if (small->count > SMALL_MAX) continue;
+        for (char key = PRINTABLE_MIN; 
+             key < PRINTABLE_MIN + PRINTABLE_NUM; key++) {
+            found_sse2 += find_key_sse2(small->keys, small->count, key) + 
+                          find_above_sse2(small->keys, small->count, key);
+        }
     }
-    /* Ensure characters are within ASCII range and a valid input file format */
-    if (((c != EOF) && (c < INT_ZER || c >= ASCII_MAX))
-       || (c == EOF && (stage_num != STAGE_2))) { 
-        printf("Invalid test file, program terminated\n");
-        exit(EXIT_FAILURE);
-    } 
-    return c;
+    end_phase(watch, "find_sse2", probes, "probes");
+    assert(found_sse2 == found);
+#endif
 }
 
-/* Build automaton using input statements in stage 0 */
-automaton_t *construct_automaton(void) {
-    automaton_t *automaton = get_new_automaton();  
-    int c, insert_vertical = TRUE, compare_root = TRUE;
+/* Start timing a phase. Peak RSS is reset where the kernel allows it, so 
+that it is the peak of this phase rather than of the program so far */
+void start_phase(stopwatch_t *watch) {
+    if (!watch->on) return;
+    FILE *fp = watch->fp ? fopen("/proc/self/clear_refs", "w") : NULL;
+    if (fp) {
+        fputs(PEAK_RESET, fp);
+        fclose(fp);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &watch->start);
+}
 
-    while ((c = mygetchar()) != STAGE_END && c != EOF) {
-        if (c != STMNT_END) {
-            /* Insert new nodes vertically if its string is not in automaton */
-            if (insert_vertical) {
-                automaton = insert_vertically(automaton, c);
-            } else {
-                /* Insert horizonally if the same transition string is found */
-                automaton = insert_horizontally(automaton, c, 
-                                &compare_root, &insert_vertical);
-            }   
-            automaton->total->character++;  
-        } else {
-            /* Reset variables for next new statement */
-            insert_vertical = FALSE;  
-            compare_root = TRUE;
-            automaton->total->statement++; 
-            automaton->total->freq++;          
-        }    
-    } 
-    return automaton;
+/* Record and report time taken by a phase that went through a number of 
+items */
+void end_phase(stopwatch_t *watch, const char *phase, long items, 
+               const char *unit) {
+    if (!watch->on) return;
+    struct timespec finish;
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double seconds = (finish.tv_sec - watch->start.tv_sec) + 
+                     (finish.tv_nsec - watch->start.tv_nsec) / 1e9;
+    if (watch->num < PHASES_MAX) {
+        watch->phases[watch->num++] = (phase_t){phase, seconds, items};
+    }
+    if (!watch->fp) return;
+    fprintf(watch->fp, PHSFMT, phase, seconds, items, unit, 
+            seconds > 0 ? items / seconds : 0.0, get_peak_rss());
 }
 
-/* Print all information in stage 0 */
-void process_stage_0(automaton_t *automaton) {
-    assert(automaton);  
-    printf(SDELIM, INT_ZER);
-    printf(NOSFMT, automaton->total->statement);
-    printf(NOCFMT, automaton->total->character);
-    printf(NPSFMT, automaton->total->state);
+/* Get peak RSS in kilobytes since it was last reset, or since start of 
+program where it cannot be */
+long get_peak_rss(void) {
+    char line[FORMAT_MAX];
+    long peak = INT_ZER;
+    FILE *fp = fopen("/proc/self/status", "r");
+    if (fp) {
+        while (fgets(line, FORMAT_MAX, fp)) {
+            if (sscanf(line, "VmHWM: %ld", &peak) == INT_ONE) break;
+        }
+        fclose(fp);
+    }
+    if (!peak) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        peak = usage.ru_maxrss;
+    }
+    return peak;
 }
 
-/* Calling functions to print output strings in stages 1 and 2 */
-void process_prompt(automaton_t *automaton, int stage_num) {
-    assert(automaton);  
-    if (stage_num == STAGE_1) printf(SDELIM, STAGE_1);
-    
-    int c, char_count = 0, index = 0;
-    int first_input = TRUE, terminate = FALSE;
-    /* Ensure last 2 characters of test file are not '\n' followed by EOF */
-    int previously_newline = FALSE;
-
-    while ((c = mygetchar()) != STAGE_END) { 
-        /* Add suffix as provided in automaton to a given input prompt, 
-        following newline character */
-        if (c == STMNT_END || c == EOF) {
-            if (!terminate && !previously_newline) {
-                print_suffix(automaton, &char_count, &index);
+/* Instrumentation functions *************************************************/
+/* Add counters of a query or a shard to those of automaton */
+void add_stats(stats_t *to, stats_t *from) {
+    for (int i = 0; i < NUM_COUNTERS; i++) to->counts[i] += from->counts[i];
+}
+
+/* Count lists by fanout and leaves by depth. Worklist holds a list and its 
+depth in turn, so that deep automata need no recursion */
+void get_shape(automaton_t *automaton, shape_t *shape) {
+    memset(shape, 0, sizeof(*shape));
+    worklist_t worklist = {NULL, INT_ZER, INT_ZER};
+    frozen_t *frozen = automaton->frozen;
+    if (frozen) {
+        /* Cells of a list follow each other, root is cell 0 */
+        push_node(&worklist, INT_ZER);
+        push_node(&worklist, INT_ZER);
+        while (worklist.num) {
+            uint32_t depth = worklist.refs[--worklist.num];
+            cell_t *cell = frozen->cells + worklist.refs[--worklist.num];
+            if (!cell->count) {
+                if (depth) add_depth(shape, depth);
+                continue;
+            }
+            shape->fanout[cell->count]++;
+            for (uint32_t i = 0; i < cell->count; i++) {
+                push_node(&worklist, cell->first + i);
+                push_node(&worklist, depth + INT_ONE);
+            }
+        }
+    } else if (automaton->outputs->head) {
+        push_node(&worklist, automaton->outputs->head);
+        push_node(&worklist, INT_ONE);
+    }
+    while (worklist.num) {
+        uint32_t depth = worklist.refs[--worklist.num];
+        node_t *anchor = get_node(automaton, worklist.refs[--worklist.num]);
+        node_t *first = anchor;
+        while (first->left) first = get_node(automaton, first->left);
+        uint32_t fanout = INT_ZER;
+        for (node_t *curr_node = first; curr_node; 
+             curr_node = get_node(automaton, curr_node->right)) {
+            fanout++;
+            if (curr_node->down) {
+                push_node(&worklist, curr_node->down);
+                push_node(&worklist, depth + INT_ONE);
+            } else {
+                add_depth(shape, depth);
             }
-            if (c == EOF) return;
-            char_count = index = 0;
-            first_input = TRUE;
-            terminate = FALSE; 
-            previously_newline = TRUE;
-        /* Print input prompts (prefix) after every newline */
-        } else if (!terminate && char_count < OUTPUT_MAX) {
-            previously_newline = FALSE;
-            print_prefix(automaton, c, &char_count, &first_input, &terminate,
-                         &index);
         }
+        shape->fanout[fanout]++;
     }
+    free(worklist.refs);
 }
 
-/* Print all information in stage 2 */
-void print_stage_2_header(automaton_t *automaton) {
-    assert(automaton);
-    printf(SDELIM, STAGE_2);
-    printf(NPSFMT, automaton->total->state);
-    printf(TFQFMT, automaton->total->freq);
-    printf(MDELIM);
+/* Count a leaf in the power of two bucket of its depth */
+void add_depth(shape_t *shape, uint32_t depth) {
+    int bucket = DEPTH_BUCKETS - INT_ONE - __builtin_clz(depth);
+    shape->depth[bucket]++;
 }
 
-/* Functions to get new memory spaces *****************************************/
-/* Create new node */
-node_t *get_new_node(void) {
-    node_t *new = (node_t *)malloc(sizeof(*new));
-    assert(new);
-    new->right = new->down = new->up = new->left = NULL;
-    new->str = NULL;
-    new->state = get_new_state();   
-    return new;
+/* Write counters, timed phases and shape of automaton as a JSON object to 
+a file, or to stderr for STATS_STDERR */
+void report_stats(char *path, stats_t *stats, shape_t *shape, 
+                  stopwatch_t *watch) {
+    const char *names[NUM_COUNTERS] = CNT_NAMES;
+    FILE *fp = strcmp(path, STATS_STDERR) ? fopen(path, "w") : stderr;
+    if (!fp) {
+        fprintf(stderr, "Cannot write report %s: %s\n", path, 
+                strerror(errno));
+        return;
+    }
+#ifdef AUTOMATON_STATS
+    fprintf(fp, "{\"counters_enabled\": true, \"counters\": {");
+#else
+    fprintf(fp, "{\"counters_enabled\": false, \"counters\": {");
+#endif
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        fprintf(fp, "%s\"%s\": %llu", i ? ", " : "", names[i], 
+                (unsigned long long)stats->counts[i]);
+    }
+    fprintf(fp, "}, \"phases\": [");
+    for (int i = 0; i < watch->num; i++) {
+        fprintf(fp, "%s{\"phase\": \"%s\", \"seconds\": %.6f, " 
+                "\"items\": %ld}", i ? ", " : "", watch->phases[i].name, 
+                watch->phases[i].seconds, watch->phases[i].items);
+    }
+    fprintf(fp, "], \"fanout\": {");
+    for (int i = 0, first = TRUE; i <= ASCII_MAX; i++) {
+        if (!shape->fanout[i]) continue;
+        fprintf(fp, "%s\"%d\": %llu", first ? "" : ", ", i, 
+                (unsigned long long)shape->fanout[i]);
+        first = FALSE;
+    }
+    fprintf(fp, "}, \"depth\": {");
+    for (int i = 0, first = TRUE; i < DEPTH_BUCKETS; i++) {
+        if (!shape->depth[i]) continue;
+        fprintf(fp, "%s\"%u\": %llu", first ? "" : ", ", 
+                (uint32_t)INT_ONE << i, (unsigned long long)shape->depth[i]);
+        first = FALSE;
+    }
+    fprintf(fp, "}}\n");
+    if (fp != stderr) fclose(fp);
 }
 
-/* Create new state */
-state_t *get_new_state(void) {
-    state_t *new = (state_t *)malloc(sizeof(*new));
-    assert(new);
-    new->visited = new->freq = INT_ZER;
-    return new;
+/* Snapshot functions ********************************************************/
+/* Write header, then every array of automaton to a snapshot file */
+void save_automaton(automaton_t *automaton, char *path) {
+    assert(!automaton->frozen);
+    memory_t *memory = automaton->memory;
+    snapshot_t snapshot;
+    memset(&snapshot, 0, sizeof(snapshot));
+    memcpy(snapshot.magic, SNAP_MAGIC, MAGIC_LEN);
+    snapshot.node_size = sizeof(node_t);
+    snapshot.small_size = sizeof(small_t);
+    snapshot.big_size = sizeof(big_t);
+    snapshot.head = automaton->outputs->head;
+    snapshot.total = *automaton->total;
+    snapshot.num_nodes = memory->nodes.num;
+    snapshot.num_smalls = memory->smalls.num;
+    snapshot.num_bigs = memory->bigs.num;
+    snapshot.num_chars = memory->num_chars;
+    snapshot.freed_nodes = memory->nodes.freed;
+    snapshot.freed_smalls = memory->smalls.freed;
+    snapshot.freed_bigs = memory->bigs.freed;
+    memcpy(snapshot.freed_str, memory->freed_str, sizeof(memory->freed_str));
+    radix_t *radix = automaton->radix;
+    snapshot.kept = radix != NULL;
+    uint32_t words = sizeof(merged_t) / sizeof(int);
+    for (ref_t ref = INT_ONE; radix && ref < radix->max; ref++) {
+        if (radix->chains[ref]) {
+            snapshot.num_merged += INT_ONE + 
+                (get_node(automaton, ref)->len - INT_ONE) * words;
+        }
+    }
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp) snapshot_error(path, strerror(errno));
+    int failed = fwrite(&snapshot, sizeof(snapshot), INT_ONE, fp) != INT_ONE;
+    failed |= fwrite(memory->nodes.slots, sizeof(node_t), memory->nodes.num, 
+                     fp) != memory->nodes.num;
+    failed |= fwrite(memory->smalls.slots, sizeof(small_t), 
+                     memory->smalls.num, fp) != memory->smalls.num;
+    failed |= fwrite(memory->bigs.slots, sizeof(big_t), memory->bigs.num, 
+                     fp) != memory->bigs.num;
+    failed |= fwrite(memory->chars, sizeof(char), memory->num_chars, 
+                     fp) != memory->num_chars;
+    /* Each list with merged nodes above it, then those nodes */
+    for (ref_t ref = INT_ONE; radix && ref < radix->max; ref++) {
+        if (!radix->chains[ref]) continue;
+        uint32_t len = get_node(automaton, ref)->len - INT_ONE;
+        failed |= fwrite(&ref, sizeof(ref), INT_ONE, fp) != INT_ONE;
+        failed |= fwrite(radix->chains[ref], sizeof(merged_t), len, 
+                         fp) != len;
+    }
+    failed |= fclose(fp) != INT_ZER;
+    if (failed) snapshot_error(path, "write failed");
 }
 
-/* Create new automaton */
-automaton_t *get_new_automaton(void) {
+/* Map a snapshot file privately and use its arrays in place */
+automaton_t *load_automaton(char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) snapshot_error(path, strerror(errno));
+    size_t size = st.st_size;
+    if (size < sizeof(snapshot_t)) snapshot_error(path, "too short");
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 
+                     INT_ZER);
+    close(fd);
+    if (map == MAP_FAILED) snapshot_error(path, strerror(errno));
+
+    snapshot_t *snapshot = (snapshot_t *)map;
+    if (memcmp(snapshot->magic, SNAP_MAGIC, MAGIC_LEN) || 
+        snapshot->node_size != sizeof(node_t) || 
+        snapshot->small_size != sizeof(small_t) || 
+        snapshot->big_size != sizeof(big_t)) {
+        snapshot_error(path, "not a snapshot of this program");
+    }
+    size_t nodes = sizeof(snapshot_t);
+    size_t smalls = nodes + (size_t)snapshot->num_nodes * sizeof(node_t);
+    size_t bigs = smalls + (size_t)snapshot->num_smalls * sizeof(small_t);
+    size_t chars = bigs + (size_t)snapshot->num_bigs * sizeof(big_t);
+    size_t merged = chars + snapshot->num_chars;
+    if (merged + (size_t)snapshot->num_merged * sizeof(int) != size || 
+        !snapshot->num_nodes || 
+        !snapshot->num_smalls || !snapshot->num_bigs) {
+        snapshot_error(path, "truncated");
+    }
+
     automaton_t *automaton = (automaton_t *)malloc(sizeof(*automaton));
-    assert(automaton);
+    memory_t *memory = (memory_t *)malloc(sizeof(*memory));
+    assert(automaton && memory);
     automaton->outputs = get_new_list();
-    automaton->total = get_new_totals(); 
+    automaton->outputs->head = snapshot->head;
+    automaton->total = get_new_totals();
+    *automaton->total = snapshot->total;
+    automaton->memo = get_new_memo();
+    automaton->version = INT_ZER;
+    automaton->path = get_new_path();
+    automaton->frozen = NULL;
+    memset(&automaton->stats, 0, sizeof(automaton->stats));
+    automaton->radix = NULL;
+    automaton->ranks = NULL;
+    automaton->memory = memory;
+    memory->nodes = (pool_t){(char *)map + nodes, sizeof(node_t), 
+        snapshot->num_nodes, snapshot->num_nodes, snapshot->freed_nodes};
+    memory->smalls = (pool_t){(char *)map + smalls, sizeof(small_t), 
+        snapshot->num_smalls, snapshot->num_smalls, snapshot->freed_smalls};
+    memory->bigs = (pool_t){(char *)map + bigs, sizeof(big_t), 
+        snapshot->num_bigs, snapshot->num_bigs, snapshot->freed_bigs};
+    memory->chars = (char *)map + chars;
+    memory->num_chars = memory->max_chars = snapshot->num_chars;
+    memcpy(memory->freed_str, snapshot->freed_str, sizeof(memory->freed_str));
+    memory->map = map;
+    memory->map_size = size;
+    check_snapshot(automaton, path);
+    if (snapshot->kept) load_merged(automaton, path, (char *)map + merged);
     return automaton;
 }
 
-/* Create new list */
-list_t *get_new_list(void) {
-    list_t *new = (list_t *)malloc(sizeof(*new));
-    assert(new);
-    new->head = new->tail = NULL;
-    return new;
+/* Check that every index and string of a mapped snapshot lies within its 
+arrays, so that a damaged file is rejected rather than followed. A released 
+slot keeps the index of the next one where its first index was */
+void check_snapshot(automaton_t *automaton, char *path) {
+    memory_t *memory = automaton->memory;
+    uint32_t nodes = memory->nodes.num, smalls = memory->smalls.num;
+    uint32_t bigs = memory->bigs.num;
+    int bad = automaton->outputs->head >= nodes || 
+              memory->nodes.freed >= nodes || memory->smalls.freed >= smalls || 
+              memory->bigs.freed >= bigs;
+    for (ref_t ref = INT_ONE; !bad && ref < nodes; ref++) {
+        node_t *node = get_node(automaton, ref);
+        uint32_t lookup = node->lookup & ~BIG_LOOKUP;
+        bad = node->down >= nodes || node->right >= nodes || 
+              node->left >= nodes || 
+              ((node->lookup & BIG_LOOKUP) ? !lookup || lookup >= bigs : 
+                                             lookup >= smalls) || 
+              (node->len > INLINE_MAX && 
+               (uint64_t)node->str + node->len > memory->num_chars);
+    }
+    for (uint32_t i = INT_ONE; !bad && i < smalls; i++) {
+        small_t *small = (small_t *)memory->smalls.slots + i;
+        bad = small->best >= nodes || small->count > SMALL_MAX;
+        for (uint32_t j = 0; !bad && j < small->count; j++) {
+            bad = small->refs[j] >= nodes;
+        }
+    }
+    for (uint32_t i = INT_ONE; !bad && i < bigs; i++) {
+        big_t *big = (big_t *)memory->bigs.slots + i;
+        bad = big->best >= nodes;
+        for (int j = 0; !bad && j < ASCII_MAX; j++) bad = big->refs[j] >= nodes;
+    }
+    /* A released string keeps the offset of the next one in its first bytes */
+    for (int class = 0; !bad && class < STR_CLASSES; class++) {
+        uint64_t size = (uint64_t)INT_ONE << (class + STR_MIN_BITS), seen = 0;
+        uint32_t str = memory->freed_str[class];
+        while (!bad && str) {
+            seen += size;
+            bad = str + size > memory->num_chars || seen > memory->num_chars;
+            if (!bad) memcpy(&str, memory->chars + str, sizeof(str));
+        }
+    }
+    if (bad) snapshot_error(path, "refers outside its arrays");
 }
 
-/* Create new totals */
-total_t *get_new_totals(void) {
-    total_t *new = (total_t *)malloc(sizeof(*new));
-    assert(new);
-    new->statement = new->freq = new->character = INT_ZER;
-    new->state = INT_ONE;
-    return new;
+/* Copy merged nodes out of a mapped snapshot, each list anchor is followed 
+by the merged nodes above it */
+void load_merged(automaton_t *automaton, char *path, char *words) {
+    snapshot_t *snapshot = (snapshot_t *)automaton->memory->map;
+    radix_t *radix = automaton->radix = get_new_radix();
+    uint32_t i = 0, size = sizeof(merged_t) / sizeof(int);
+    while (i < snapshot->num_merged) {
+        ref_t ref;
+        memcpy(&ref, words + i * sizeof(int), sizeof(ref));
+        uint32_t len = (ref && ref < snapshot->num_nodes) ? 
+                        get_node(automaton, ref)->len - INT_ONE : INT_ZER;
+        if (!len || len * size >= snapshot->num_merged - i) {
+            snapshot_error(path, "merged nodes do not match nodes");
+        }
+        merged_t *chain = (merged_t *)malloc(len * sizeof(merged_t));
+        assert(chain);
+        memcpy(chain, words + (i + INT_ONE) * sizeof(int), 
+               len * sizeof(merged_t));
+        set_chain(radix, ref, chain);
+        i += len * size + INT_ONE;
+    }
 }
 
-/* Convert single character to a string */
-char *get_string(char *c) {
-    char *str = (char *)malloc(INT_TWO * (sizeof(char)));
-    assert(str);
-    str[INT_ZER] = *c;
-    str[INT_ONE] = NUL_CH;
-    return str;
+/* Copy arrays of a mapped snapshot to the heap so they can grow */
+void thaw_memory(memory_t *memory) {
+    thaw_array(&memory->nodes.slots, memory->nodes.max * memory->nodes.size);
+    thaw_array(&memory->smalls.slots, 
+               memory->smalls.max * memory->smalls.size);
+    thaw_array(&memory->bigs.slots, memory->bigs.max * memory->bigs.size);
+    thaw_array(&memory->chars, memory->max_chars);
+    munmap(memory->map, memory->map_size);
+    memory->map = NULL;
+    memory->map_size = INT_ZER;
 }
 
-/* Combine two strings to a new memory space, re-order string1 before string2 */
-char *combine_str(char *p1, char *p2) {
-    char *str = (char *)malloc((strlen(p1) + strlen(p2) + 1) * sizeof(char));
-    strcpy(str, p1);
-    strcat(str, p2);
-    free(p2);
-    return str;
+/* Copy an array to the heap */
+void thaw_array(char **array, size_t size) {
+    char *copy = (char *)malloc(size);
+    assert(copy);
+    memcpy(copy, *array, size);
+    *array = copy;
 }
 
-/* Insertion functions *******************************************************/
-/* Insert new node directly below previous node pointed by tail pointer */
-automaton_t *insert_vertically(automaton_t *automaton, char c) {
-    assert(automaton);
-    node_t *newnode = get_new_node();
-    newnode->str = get_string(&c);
-    automaton->total->state++; 
-    /* Update frequency of previous node if traversed pass */
-    if (automaton->outputs->tail) {
-        automaton->outputs->tail->state->freq++;
-        automaton->total->freq++;
-    } 
-    /* Assign tail pointer to new node. If root node, also assign head */ 
-    if (!automaton->outputs->head) {
-        automaton->outputs->head = automaton->outputs->tail = newnode;
-    } else {
-        automaton->outputs->tail->down = newnode;
-        newnode->up = automaton->outputs->tail;
-        automaton->outputs->tail = newnode;
-    } 
-    return automaton;
+/* Reject a snapshot file that cannot be used */
+void snapshot_error(char *path, char *reason) {
+    fprintf(stderr, "Snapshot %s: %s, program terminated\n", path, reason);
+    exit(EXIT_FAILURE);
 }
 
-/* Insert new node to left or right of previous node pointed by tail pointer */
-automaton_t *insert_horizontally(automaton_t *automaton, char c, 
-                                   int *compare_root, int *invert_vertical) {
-    assert(automaton);
-    node_t *new_node = get_new_node(), *curr_node;
-    new_node->str = get_string(&c);
-    automaton->total->state++; 
-    
-    /* Reassign curr_node to root node for every new statement */
-    if (*compare_root) {
-        curr_node = automaton->outputs->head;
-    } else {
-        /* Ensure valid addition of new node below leaf node */
-        if (!automaton->outputs->tail->down) {
-            automaton->outputs->tail->down = new_node;
-            new_node->up = automaton->outputs->tail;
-            automaton->outputs->tail = new_node;
-            /* From now on, insert vertically */
-            *invert_vertical = TRUE;
-            return automaton;
-        } 
-        curr_node = automaton->outputs->tail->down; 
-    } 
-    
-    /* During processing of each prompt, update freq of previous node */
-    if (curr_node != automaton->outputs->head) {
-        automaton->outputs->tail->state->freq++;
-        automaton->total->freq++;
-    } 
-    int result = strcmp(new_node->str, curr_node->str);
-    /* If equal, reassign tail to current node */
-    if (result == 0) {
-        insert_equal_result(automaton, curr_node, new_node);
-        *compare_root = FALSE;
-    } else {
-        /* Insert new node in ascending ASCII order for left-hand side */
-        if (result < 0) {
-            insert_unequal_result(automaton, LEFT, curr_node, new_node, 
-                                  compare_root, invert_vertical);
-        /* Insert new node in descending ASCII order for right-hand side */
-        } else if (result > 0) {
-            insert_unequal_result(automaton, RIGHT, curr_node, new_node, 
-                                  compare_root, invert_vertical);
+/* Server functions **********************************************************/
+/* Answer requests of clients on a Unix domain socket until asked to quit. 
+Prompts are answered on this thread from the version of automaton it has 
+pinned, while training requests are carried out by a writer thread on a 
+copy. Returns latest version of automaton */
+automaton_t *serve_automaton(automaton_t *automaton, char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket %s: name too long\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+    /* A client going away must not end server */
+    signal(SIGPIPE, SIG_IGN);
+    int listener = socket(AF_UNIX, SOCK_STREAM, INT_ZER);
+    unlink(path);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, 
+                             sizeof(addr)) || listen(listener, SOMAXCONN)) {
+        fprintf(stderr, "Socket %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    trainer_t *trainer = start_trainer(automaton);
+    query_t *query = get_new_query(automaton);
+    client_t clients[CLIENTS_MAX] = {{INT_ZER}};
+    struct pollfd fds[CLIENTS_MAX + INT_TWO];
+    for (int i = 0; i < CLIENTS_MAX; i++) clients[i].fd = NO_FD;
+    int running = TRUE;
+    while (running) {
+        fds[INT_ZER] = (struct pollfd){listener, POLLIN, INT_ZER};
+        /* A client waiting for training is not read from meanwhile */
+        for (int i = 0; i < CLIENTS_MAX; i++) {
+            int fd = clients[i].waiting ? NO_FD : clients[i].fd;
+            fds[i + INT_ONE] = (struct pollfd){fd, POLLIN, INT_ZER};
+        }
+        fds[CLIENTS_MAX + INT_ONE] = 
+            (struct pollfd){trainer->notify[INT_ZER], POLLIN, INT_ZER};
+        if (poll(fds, CLIENTS_MAX + INT_TWO, NO_TIMEOUT) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[INT_ZER].revents & POLLIN) accept_client(listener, clients);
+        for (int i = 0; i < CLIENTS_MAX && running; i++) {
+            if (fds[i + INT_ONE].revents && !receive_requests(trainer, 
+                    query, &clients[i], &trainer->jobs[i], &running)) {
+                close_client(&clients[i]);
+            }
+        }
+        if (running && fds[CLIENTS_MAX + INT_ONE].revents & POLLIN) {
+            finish_jobs(trainer, query, clients, &running);
         }
     }
+    for (int i = 0; i < CLIENTS_MAX; i++) {
+        if (clients[i].fd != NO_FD) close_client(&clients[i]);
+    }
+    close(listener);
+    unlink(path);
+    automaton = stop_trainer(trainer);
+    add_stats(&automaton->stats, &query->stats);
+    free_query(query);
     return automaton;
 }
 
-/* Remove any already existing state for equal result */
-void insert_equal_result(automaton_t *automaton, node_t *curr, node_t *new) {
-    assert(automaton && curr && new);
-    automaton->total->state--; 
-    automaton->outputs->tail = curr; 
-    free_node(new, INT_ZER);
+/* Take a new connection, turning it away if all clients are in use */
+void accept_client(int listener, client_t *clients) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) return;
+    for (int i = 0; i < CLIENTS_MAX; i++) {
+        if (clients[i].fd == NO_FD) {
+            clients[i].fd = fd;
+            clients[i].max = READ_BLOCK;
+            clients[i].buf = (char *)malloc(clients[i].max);
+            assert(clients[i].buf);
+            clients[i].num = INT_ZER;
+            clients[i].writer = get_new_writer(fd, NULL);
+            clients[i].waiting = FALSE;
+            return;
+        }
+    }
+    close(fd);
 }
 
-/* Compare all nodes for further equal result, otherwise insert left or right */
-void insert_unequal_result(automaton_t *automaton, int result, node_t *curr, 
-                         node_t *new, int *compare_root, int *insert_vertical) {
-    while (curr) {
-        /* Insert new node to the edge of linked list (left/right) */
-        if ((result == LEFT && !curr->left) || 
-            (result == RIGHT && !curr->right)){
-            if (result == LEFT) {
-                new->right = curr;
-                curr->left = new; 
-            } else {
-                new->left = curr;
-                curr->right = new;
+/* Read from a client and answer its requests. Returns FALSE once client is 
+gone or sends a malformed request */
+int receive_requests(trainer_t *trainer, query_t *query, client_t *client, 
+                     job_t *job, int *running) {
+    ssize_t n = read(client->fd, client->buf + client->num, 
+                     client->max - client->num);
+    if (n < 0 && errno == EINTR) return TRUE;
+    if (n <= 0) return FALSE;
+    client->num += n;
+    return answer_requests(trainer, query, client, job, running);
+}
+
+/* Answer every complete request received from a client in order, stopping 
+after one that waits for training. Returns FALSE on a malformed request */
+int answer_requests(trainer_t *trainer, query_t *query, client_t *client, 
+                    job_t *job, int *running) {
+    size_t pos = INT_ZER;
+    while (*running && !client->waiting && client->num - pos >= HEADER_LEN) {
+        uint32_t len = get_length(client->buf + pos);
+        if (!len || len > REQUEST_MAX) return FALSE;
+        /* Wait for rest of request, making room for it */
+        if (client->num - pos - HEADER_LEN < len) {
+            if (HEADER_LEN + len > client->max) {
+                client->max = HEADER_LEN + len;
+                client->buf = (char *)realloc(client->buf, client->max);
+                assert(client->buf);
             }
-            automaton->outputs->tail = new;
-            *insert_vertical = TRUE;
-            return;
+            break;
         }
-        /* Search through all left/right nodes */
-        if (result == LEFT) curr = curr->left;
-        if (result == RIGHT) curr = curr->right;
-
-        /* If the same string is found, reassign tail */
-        int new_result = strcmp(new->str, curr->str);
-        if (new_result == 0) {
-            insert_equal_result(automaton, curr, new);
-            *compare_root = FALSE;
-            return;
+        handle_request(trainer, query, client, job, 
+                       client->buf + pos + HEADER_LEN, len, running);
+        pos += HEADER_LEN + len;
+    }
+    memmove(client->buf, client->buf + pos, client->num - pos);
+    client->num -= pos;
+    /* Send all responses before waiting for more requests */
+    flush_writer(client->writer);
+    return TRUE;
+}
 
-        /* If insertion in-between nodes is possible due to ASCII ordering */
-        } else if (new_result > 0) {
-            if (result == LEFT) insert_inbetween_left(new, curr);
-            if (result == RIGHT) insert_inbetween_right(new, curr);
-            automaton->outputs->tail = new;
-            *insert_vertical = TRUE;
-            return;
+/* Carry out a request and add its response, timed from start to finish. A 
+training request is handed to writer thread, to be responded to once done */
+void handle_request(trainer_t *trainer, query_t *query, client_t *client, 
+                    job_t *job, char *request, uint32_t len, int *running) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    automaton_t *automaton = trainer->pinned;
+    char op = request[INT_ZER], *arg = request + INT_ONE, out[FORMAT_MAX];
+    int status = STATUS_OK, out_len = INT_ZER;
+    len--;
+    if (op == OP_COMPLETE) {
+        out_len = complete_prompt(automaton, query, arg, len, out);
+        if (out_len == BAD_PROMPT) {
+            status = STATUS_BAD;
+            out_len = INT_ZER;
         }
-    } 
+    } else if (can_train(automaton, op, arg, len)) {
+        pthread_mutex_lock(&trainer->lock);
+        *job = (job_t){JOB_QUEUED, trainer->next_seq++, op, 
+                       (char *)malloc(len + INT_ONE), len, start, 
+                       STATUS_OK, {NUL_CH}, INT_ZER};
+        assert(job->arg);
+        memcpy(job->arg, arg, len);
+        pthread_cond_signal(&trainer->wake);
+        pthread_mutex_unlock(&trainer->lock);
+        client->waiting = TRUE;
+        return;
+    } else if (op == OP_QUIT) {
+        *running = FALSE;
+    } else {
+        status = STATUS_BAD;
+    }
+    put_response(client->writer, status, &start, out, out_len);
 }
 
-/* Insert new node in-between 2 existing nodes (left side) */
-void insert_inbetween_left(node_t *new_node, node_t *curr_node) {
-    assert(new_node && curr_node);
-    new_node->left = curr_node; 
-    new_node->right = curr_node->right; 
-    curr_node->right->left = new_node;
-    curr_node->right = new_node; 
+/* Check a training request can be carried out, a frozen automaton cannot 
+change and statements are only appended if freq of merged nodes is kept */
+int can_train(automaton_t *automaton, char op, char *arg, uint32_t len) {
+    if (automaton->frozen) return FALSE;
+    if (op == OP_COMPRESS) return TRUE;
+    if (op != OP_APPEND || !automaton->radix) return FALSE;
+    for (uint32_t i = 0; i < len; i++) {
+        if ((unsigned char)arg[i] >= ASCII_MAX) return FALSE;
+    }
+    return TRUE;
 }
 
-/* Insert new node in-between 2 existing nodes (right side) */
-void insert_inbetween_right(node_t *new_node, node_t *curr_node) {
-    assert(new_node && curr_node);
-    new_node->left = curr_node->left; 
-    new_node->right = curr_node; 
-    curr_node->left->right = new_node;
-    curr_node->left = new_node; 
+/* Add a response of a request that started at a given time */
+void put_response(writer_t *writer, int status, struct timespec *start, 
+                  char *out, int out_len) {
+    struct timespec finish;
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    uint32_t micros = (finish.tv_sec - start->tv_sec) * 1000000 + 
+                      (finish.tv_nsec - start->tv_nsec) / 1000;
+    put_length(writer, INT_ONE + HEADER_LEN + out_len);
+    put_char(writer, status);
+    put_length(writer, micros);
+    put_chars(writer, out, out_len);
 }
 
-/* Printing functions ********************************************************/
-/* Process first-half of stages 1 and 2 input prompts and print to STDOUT */
-void print_prefix(automaton_t *automaton, char c, int *char_count,
-                    int *first_input, int *terminate, int *index) {
-    node_t *curr_node;
-    static int str_len = 0; 
-    putchar(c);
-    (*char_count)++;
+/* Disconnect a client, sending what is left of its responses */
+void close_client(client_t *client) {
+    free_writer(client->writer);
+    close(client->fd);
+    free(client->buf);
+    client->fd = NO_FD;
+}
 
-    /* Reset curr_node to head for every new input prompt */
-    if (*first_input) {
-        curr_node = automaton->outputs->head;
-        *first_input = FALSE;
-        *index = 0;
-        str_len = strlen(curr_node->str);
-    } else {
-        /* If leaf node is reached, terminate the searching */
-        if (!automaton->outputs->tail->down && 
-            !automaton->outputs->tail->str[*index]) {   
-            *terminate = TRUE;
-            *index = str_len = 0;
-            print_ellipses(char_count);
-            putchar(NEWLIN);
-            return;
-        /* If the entire transition string has been searched, reassign tail */
-        } else if (*index >= str_len) {
-            curr_node = automaton->outputs->tail->down;
-            str_len = strlen(curr_node->str);
-            *index = 0;
-        /* Otherwise, search through the same string of previous node */
-        } else {
-            curr_node = automaton->outputs->tail;
+/* Read a big-endian length of a message */
+uint32_t get_length(char *header) {
+    unsigned char *bytes = (unsigned char *)header;
+    return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | 
+           (uint32_t)bytes[2] << 8 | bytes[3];
+}
+
+/* Add a big-endian length of a message to output */
+void put_length(writer_t *writer, uint32_t len) {
+    char header[HEADER_LEN] = {len >> 24, len >> 16, len >> 8, len};
+    put_chars(writer, header, HEADER_LEN);
+}
+
+/* Training functions ********************************************************/
+/* Start writer thread training copies of automaton, which is pinned by 
+server thread for now */
+trainer_t *start_trainer(automaton_t *automaton) {
+    trainer_t *trainer = (trainer_t *)malloc(sizeof(*trainer));
+    assert(trainer);
+    trainer->pinned = trainer->published = automaton;
+    trainer->retired = trainer->standby = NULL;
+    trainer->batches = trainer->pinned_batches = INT_ZER;
+    trainer->retired_batches = trainer->standby_batches = INT_ZER;
+    trainer->log = NULL;
+    trainer->num_log = trainer->max_log = INT_ZER;
+    memset(trainer->jobs, 0, sizeof(trainer->jobs));
+    trainer->next_seq = INT_ZER;
+    trainer->stopping = FALSE;
+    int failed = pipe(trainer->notify);
+    failed |= pthread_mutex_init(&trainer->lock, NULL);
+    failed |= pthread_cond_init(&trainer->wake, NULL);
+    failed |= pthread_create(&trainer->thread, NULL, run_trainer, trainer);
+    assert(!failed);
+    return trainer;
+}
+
+/* Carry out queued training requests on a copy of latest version, oldest 
+first, then publish the copy as latest version. Versions retired by server 
+thread, and latest version once replaced if it was never pinned, are kept 
+as standby or freed */
+void *run_trainer(void *arg) {
+    trainer_t *trainer = (trainer_t *)arg;
+    int order[CLIENTS_MAX];
+    pthread_mutex_lock(&trainer->lock);
+    while (TRUE) {
+        int num = get_queued(trainer, order);
+        if (trainer->retired) {
+            automaton_t *retired = trainer->retired;
+            uint32_t batches = trainer->retired_batches;
+            trainer->retired = NULL;
+            pthread_mutex_unlock(&trainer->lock);
+            keep_standby(trainer, retired, batches);
+            pthread_mutex_lock(&trainer->lock);
+            continue;
         }
+        if (trainer->stopping) break;
+        if (!num) {
+            pthread_cond_wait(&trainer->wake, &trainer->lock);
+            continue;
+        }
+        automaton_t *latest = trainer->published;
+        uint32_t batches = trainer->batches;
+        pthread_mutex_unlock(&trainer->lock);
+
+        automaton_t *copy = get_standby(trainer, latest);
+        for (int i = 0; i < num; i++) {
+            log_job(trainer, &trainer->jobs[order[i]], batches + INT_ONE);
+            train_copy(copy, &trainer->jobs[order[i]]);
+        }
+        pthread_mutex_lock(&trainer->lock);
+        trainer->published = copy;
+        trainer->batches = batches + INT_ONE;
+        for (int i = 0; i < num; i++) {
+            trainer->jobs[order[i]].state = JOB_DONE;
+        }
+        int pinned = latest == trainer->pinned;
+        uint32_t pinned_batches = trainer->pinned_batches;
+        automaton_t *retired = trainer->retired;
+        uint32_t retired_batches = trainer->retired_batches;
+        trainer->retired = NULL;
+        pthread_mutex_unlock(&trainer->lock);
+        char done = JOB_DONE;
+        ssize_t n = write(trainer->notify[INT_ONE], &done, sizeof(done));
+        assert(n == sizeof(done));
+        if (!pinned) keep_standby(trainer, latest, batches);
+        if (retired) keep_standby(trainer, retired, retired_batches);
+        /* Pinned version is retired later and may be kept then */
+        prune_log(trainer, trainer->standby && 
+                  trainer->standby_batches < pinned_batches ? 
+                  trainer->standby_batches : pinned_batches);
+        pthread_mutex_lock(&trainer->lock);
     }
-    /* Handle unmatched character */
-    if (!find_matching_char(automaton, curr_node, c, index)) {
-        *terminate = TRUE;
-        print_ellipses(char_count);
-        putchar(NEWLIN);
-    }
+    pthread_mutex_unlock(&trainer->lock);
+    return NULL;
 }
 
-/* Compare character using string indexing then search for same left or right */
-int find_matching_char(automaton_t *automaton, node_t *curr, char c, int*index){
-    int fixed = FALSE;
-    while (curr) {
-        /* If character matches, record its index */
-        if (c == curr->str[*index]) {
-            automaton->outputs->tail = curr;
-            (*index)++;
-            return TRUE;           
-        /* Otherwise, loop through one side only (fixed) */
-        } else if (c < curr->str[*index] && !fixed) {
-            fixed = LEFT;
-        } else if (c > curr->str[*index] && !fixed) {
-            fixed = RIGHT;
+/* Get clients of queued training requests in order they arrived. Returns 
+number of them */
+int get_queued(trainer_t *trainer, int *order) {
+    int num = 0;
+    for (int i = 0; i < CLIENTS_MAX; i++) {
+        if (trainer->jobs[i].state != JOB_QUEUED) continue;
+        int j = num++;
+        for (; j > 0 && trainer->jobs[order[j - INT_ONE]].seq > 
+                        trainer->jobs[i].seq; j--) {
+            order[j] = order[j - INT_ONE];
         }
-        if (fixed == LEFT) curr = curr->left;
-        if (fixed == RIGHT) curr = curr->right;
-    } 
-    return FALSE;
+        order[j] = i;
+    }
+    return num;
 }
 
-/* Process second-half of stages 1 and 2 input prompts and print to STDOUT */
-void print_suffix(automaton_t *automaton, int *char_count, int *index) {
-    assert(automaton);
-    print_ellipses(char_count);
-
-    /* If string of node pointed by tail was not printed out completely */
-    int remain = FALSE;
-    if (*index < ((int)strlen(automaton->outputs->tail->str))) remain = TRUE;
-    /* Assign current node to either the node at same level or below it */
-    node_t *curr_node;
-    if (remain) curr_node = automaton->outputs->tail;
-    if (!remain) curr_node = automaton->outputs->tail->down;
-
-    /* Search for node with higher freq. If equal, search for higher ASCII */
-    while (*char_count < OUTPUT_MAX && curr_node) {
-        int highest_freq = curr_node->state->freq;
-        char *highest_ascii = curr_node->str;
-
-        int left = find_x_node_left(automaton, curr_node, &highest_freq);
-        int right = find_x_node_right(automaton, curr_node, &highest_freq, 
-                                      highest_ascii);
-        if (!left && !right) automaton->outputs->tail = curr_node;
-
-        /* As pointed by tail, if remain, print only remaining suffix */
-        int starting_index = INT_ZER;
-        if (remain) {
-            starting_index = *index;
-            remain = FALSE;
-        } 
-        /* Otherwise, print entire string */
-        print_char(automaton->outputs->tail, char_count, starting_index);
-        curr_node = automaton->outputs->tail->down;
+/* Carry out a training request on a copy nobody else reads */
+void train_copy(automaton_t *copy, job_t *job) {
+    if (job->op == OP_COMPRESS) {
+        char num_compress_str[NUM_MAX];
+        uint32_t len = job->len < NUM_MAX ? job->len : NUM_MAX - INT_ONE;
+        memcpy(num_compress_str, job->arg, len);
+        num_compress_str[len] = NUL_CH;
+        compress_automaton(copy, atoi(num_compress_str));
+    } else {
+        /* Statements were checked to be valid on arrival */
+        reader_t *reader = get_text_reader(job->arg, job->len);
+        append_statements(copy, reader, NULL);
+        free_reader(reader);
     }
-    putchar(NEWLIN);
+    job->out_len = snprintf(job->out, FORMAT_MAX, NPSFMT TFQFMT, 
+                            copy->total->state, copy->total->freq);
 }
 
-/* Loop through left nodes to find nodes with highest freq only */
-int find_x_node_left(automaton_t *automaton, node_t *curr, int *highest_freq) {
-    node_t *left_node = curr->left;   
-    int left = FALSE;
-    while (left_node) {
-        if (left_node->state->freq > *highest_freq) {
-            automaton->outputs->tail = left_node;
-            *highest_freq = left_node->state->freq;
-            left = TRUE;
-        }
-        left_node = left_node->left;
+/* Get a copy of latest version to train. Standby is brought up to date by 
+carrying out again the requests it lacks, without one latest version is 
+copied whole */
+automaton_t *get_standby(trainer_t *trainer, automaton_t *latest) {
+    automaton_t *copy = trainer->standby;
+    if (!copy) return clone_automaton(latest);
+    trainer->standby = NULL;
+    /* As in a copy, latest statement's path is not carried over */
+    copy->path->len = INT_ZER;
+    for (uint32_t i = 0; i < trainer->num_log; i++) {
+        logged_t *logged = &trainer->log[i];
+        if (logged->batch <= trainer->standby_batches) continue;
+        job_t job;
+        job.op = logged->op;
+        job.arg = logged->arg;
+        job.len = logged->len;
+        train_copy(copy, &job);
     }
-    return left;
+    copy->stats = latest->stats;
+    return copy;
 }
 
-/* Loop through right nodes to find nodes with highest freq and ascii */
-int find_x_node_right(automaton_t *automaton, node_t *curr, int *highest_freq, 
-                      char *highest_ascii) {
-    node_t *right_node = curr->right;
-    int right = FALSE;
-    while (right_node) {
-        if ((right_node->state->freq > *highest_freq) || 
-            (right_node->state->freq == *highest_freq && 
-                strcmp(right_node->str, highest_ascii) > 0)) {
-            automaton->outputs->tail = right_node;
-            *highest_freq = right_node->state->freq;
-            highest_ascii = right_node->str;
-            right = TRUE;
-        }
-        right_node = right_node->right;
+/* Keep a version let go of, that had a number of batches carried out, as 
+standby if it lacks fewer of them than standby does, and free the other */
+void keep_standby(trainer_t *trainer, automaton_t *automaton, 
+                  uint32_t batches) {
+    if (trainer->standby && trainer->standby_batches >= batches) {
+        free_automaton(automaton);
+        return;
     }
-    return right;
+    if (trainer->standby) free_automaton(trainer->standby);
+    trainer->standby = automaton;
+    trainer->standby_batches = batches;
 }
 
-/* print ellipses under 37 character limit*/
-void print_ellipses(int *char_count) {
-    for (int i = 0; *char_count < OUTPUT_MAX && i < INT_THR; i++, 
-         (*char_count)++) {
-        putchar(ELLIPSE);
+/* Record a training request carried out in a batch, to carry it out again 
+on versions that lack it */
+void log_job(trainer_t *trainer, job_t *job, uint32_t batch) {
+    if (trainer->num_log == trainer->max_log) {
+        trainer->max_log = trainer->max_log ? trainer->max_log * INT_TWO : 
+                                              INIT_SLOTS;
+        trainer->log = (logged_t *)realloc(trainer->log, 
+                                           trainer->max_log * 
+                                           sizeof(logged_t));
+        assert(trainer->log);
     }
+    char *arg = (char *)malloc(job->len + INT_ONE);
+    assert(arg);
+    memcpy(arg, job->arg, job->len);
+    trainer->log[trainer->num_log++] = 
+        (logged_t){job->op, arg, job->len, batch};
 }
 
-/* print characters under 37 character limit */
-void print_char(node_t *node, int *char_count, int index) {
-    int str_len = strlen(node->str);
-    for (; index < str_len && *char_count < OUTPUT_MAX; index++, 
-         (*char_count)++) {
-        putchar(node->str[index]);
+/* Drop requests of up to a number of batches, no version left lacks them */
+void prune_log(trainer_t *trainer, uint32_t batches) {
+    uint32_t num = 0;
+    while (num < trainer->num_log && trainer->log[num].batch <= batches) {
+        free(trainer->log[num++].arg);
+    }
+    trainer->num_log -= num;
+    memmove(trainer->log, trainer->log + num, 
+            trainer->num_log * sizeof(logged_t));
+}
+
+/* Pin latest version, retiring one let go of, and respond to clients whose 
+training is done, then go on with requests they sent meanwhile */
+void finish_jobs(trainer_t *trainer, query_t *query, client_t *clients, 
+                 int *running) {
+    char done[CLIENTS_MAX];
+    if (read(trainer->notify[INT_ZER], done, sizeof(done)) < 0) return;
+    int resumed[CLIENTS_MAX], num = 0;
+    pthread_mutex_lock(&trainer->lock);
+    /* Any version retired before was taken to be freed on publishing */
+    if (trainer->pinned != trainer->published) {
+        assert(!trainer->retired);
+        trainer->retired = trainer->pinned;
+        trainer->retired_batches = trainer->pinned_batches;
+        trainer->pinned = trainer->published;
+        trainer->pinned_batches = trainer->batches;
+        pthread_cond_signal(&trainer->wake);
+    }
+    for (int i = 0; i < CLIENTS_MAX; i++) {
+        job_t *job = &trainer->jobs[i];
+        if (job->state != JOB_DONE) continue;
+        put_response(clients[i].writer, job->status, &job->start, job->out, 
+                     job->out_len);
+        free(job->arg);
+        job->state = JOB_NONE;
+        clients[i].waiting = FALSE;
+        resumed[num++] = i;
+    }
+    pthread_mutex_unlock(&trainer->lock);
+    for (int i = 0; i < num && *running; i++) {
+        client_t *client = &clients[resumed[i]];
+        if (!answer_requests(trainer, query, client, 
+                             &trainer->jobs[resumed[i]], running)) {
+            close_client(client);
+        }
     }
 }
 
+/* Stop writer thread, dropping training requests not yet carried out. 
+Returns latest version of automaton */
+automaton_t *stop_trainer(trainer_t *trainer) {
+    pthread_mutex_lock(&trainer->lock);
+    trainer->stopping = TRUE;
+    pthread_cond_signal(&trainer->wake);
+    pthread_mutex_unlock(&trainer->lock);
+    pthread_join(trainer->thread, NULL);
+    automaton_t *automaton = trainer->published;
+    if (trainer->pinned != automaton) free_automaton(trainer->pinned);
+    if (trainer->retired) free_automaton(trainer->retired);
+    if (trainer->standby) free_automaton(trainer->standby);
+    prune_log(trainer, trainer->batches);
+    free(trainer->log);
+    for (int i = 0; i < CLIENTS_MAX; i++) {
+        if (trainer->jobs[i].state) free(trainer->jobs[i].arg);
+    }
+    close(trainer->notify[INT_ZER]);
+    close(trainer->notify[INT_ONE]);
+    pthread_mutex_destroy(&trainer->lock);
+    pthread_cond_destroy(&trainer->wake);
+    free(trainer);
+    return automaton;
+}
+
 /* Compression functions *****************************************************/
 /* Compress automaton for num_compress times */
-automaton_t *compress_automaton(automaton_t *automaton) {
+automaton_t *compress_automaton(automaton_t *automaton, int num_compress) {
     assert(automaton);
-    int num_compress = get_num_compress();
+    /* States already merged while building are counted out first */
+    num_compress -= count_merged(automaton, num_compress);
+    if (num_compress <= 0) return automaton;
+    assert(!automaton->frozen);
+    /* A mapped snapshot is copied out before it is changed */
+    if (automaton->memory->map) thaw_memory(automaton->memory);
+    automaton->version++;
+    /* Nodes of latest statement are about to be merged */
+    automaton->path->len = INT_ZER;
     automaton = add_root(automaton);
 
-    /* Search for node to compress based on lower ASCII order */
-    for (int i = 0; i < num_compress; i++) {
-        /* Reallocate tail to root node after each compression */
-        node_t *x_node = automaton->outputs->head;
-        while (!x_node->state->visited) {
-            /* Perform compression if all conditions are met */
-            if (x_node->down && !x_node->down->left && !x_node->down->right 
-                && x_node->down->down) {
-                delete_node(automaton, x_node);
-                break;
-            } 
-            int new_left = FALSE, new_right = FALSE, new_down = FALSE;
-            /* Otherwise, search left side first due to ascii ordering */
-            if (x_node->down && x_node->down->left && 
-                !x_node->down->left->state->visited) {
-                x_node = traverse_automaton(x_node, LEFT, &new_left);
-            } 
-            /* If no potential x_node on left side, search downwards */ 
-            if (!new_left && x_node->down && !x_node->down->state->visited) {
-                check_visited(x_node->down, &new_down);
-                if (new_down) x_node = x_node->down;
-            }
-            /* If still no potential x_node, search right side */ 
-            if (!new_down && !new_left && x_node->down->right && 
-                !x_node->down->right->state->visited) {  
-                x_node = traverse_automaton(x_node, RIGHT, &new_right);  
-            }
-            /* If leaf node is reached but no compression has occurred, block 
-            entire branch from future visit */
-            if (!new_down && !new_left && !new_right) { 
-                x_node->state->visited = TRUE;
-                x_node = automaton->outputs->head;
-            }
+    /* Visit nodes depth first from root, lower ASCII first. Merging below a 
+    node never changes nodes above it, so a single pass over a worklist finds 
+    the same nodes in the same order as restarting from root after each one */
+    worklist_t worklist = {NULL, INT_ZER, INT_ZER};
+    push_node(&worklist, automaton->outputs->head);
+    int i = 0;
+    while (i < num_compress && worklist.num) {
+        node_t *x_node = get_node(automaton, worklist.refs[--worklist.num]);
+        COUNT(&automaton->stats, CNT_VISITS, INT_ONE);
+        /* Keep merging below x_node before moving on to its children */
+        while (i < num_compress && can_compress(automaton, x_node)) {
+            delete_node(automaton, x_node);
+            i++;
         }
+        push_children(automaton, &worklist, x_node);
     }
-    automaton->outputs->head = automaton->outputs->head->down;
+    free(worklist.refs);
+    automaton->outputs->head = 
+        get_node(automaton, automaton->outputs->head)->down;
     return automaton;
 }
 
+/* Count out states merged while building, as many as num_compress would 
+merge and in the order it would, from merged nodes not counted out yet, which 
+are the last ones in that order. Without merged nodes kept, all are counted 
+out. Returns number of states counted out */
+int count_merged(automaton_t *automaton, int num_compress) {
+    total_t *total = automaton->total;
+    radix_t *radix = automaton->radix;
+    int num = total->merged_state;
+    if (num_compress >= num || !radix) {
+        total->state -= total->merged_state;
+        total->freq -= total->merged_freq;
+        total->merged_state = total->merged_freq = INT_ZER;
+        return num > 0 ? num : INT_ZER;
+    }
+    if (num_compress <= 0) return INT_ZER;
+    uint32_t skip = 0;
+    for (ref_t ref = INT_ONE; ref < radix->max; ref++) {
+        if (radix->chains[ref]) skip += get_node(automaton, ref)->len - INT_ONE;
+    }
+    skip -= num;
+
+    /* Merged nodes above a list are merged top down when the node above it 
+    is visited, nodes are visited as compression does. Top stands above root 
+    list */
+    worklist_t worklist = {NULL, INT_ZER, INT_ZER};
+    node_t top;
+    memset(&top, 0, sizeof(top));
+    top.down = automaton->outputs->head;
+    node_t *x_node = &top;
+    int counted = 0, freq = 0;
+    while (counted < num_compress) {
+        merged_t *chain = get_chain(radix, x_node->down);
+        uint32_t len = chain ? get_node(automaton, x_node->down)->len - INT_ONE 
+                             : INT_ZER;
+        for (uint32_t i = 0; i < len && counted < num_compress; i++) {
+            if (skip) {
+                skip--;
+            } else {
+                freq += chain[i].freq;
+                counted++;
+            }
+        }
+        push_children(automaton, &worklist, x_node);
+        if (!worklist.num) break;
+        x_node = get_node(automaton, worklist.refs[--worklist.num]);
+    }
+    free(worklist.refs);
+    total->state -= counted;
+    total->freq -= freq;
+    total->merged_state -= counted;
+    total->merged_freq -= freq;
+    return counted;
+}
+
+/* Check if node below x_node has no side-way node but has a node below */
+int can_compress(automaton_t *automaton, node_t *x_node) {
+    COUNT(&automaton->stats, CNT_CHECKS, INT_ONE);
+    node_t *down = get_node(automaton, x_node->down);
+    return down && !down->left && !down->right && down->down;
+}
+
+/* Add every non-leaf node below x_node to worklist so that the lowest ASCII 
+is visited first, right-hand side descends away from anchor, left ascends */
+void push_children(automaton_t *automaton, worklist_t *worklist, 
+                   node_t *x_node) {
+    node_t *anchor = get_node(automaton, x_node->down), *curr_node;
+    if (!anchor) return;
+    for (curr_node = get_node(automaton, anchor->right); curr_node; 
+         curr_node = get_node(automaton, curr_node->right)) {
+        COUNT(&automaton->stats, CNT_SCANS, INT_ONE);
+        if (curr_node->down) {
+            push_node(worklist, get_ref(automaton, curr_node));
+        }
+    }
+    if (anchor->down) push_node(worklist, x_node->down);
+    for (curr_node = get_node(automaton, anchor->left); curr_node; 
+         curr_node = get_node(automaton, curr_node->left)) {
+        COUNT(&automaton->stats, CNT_SCANS, INT_ONE);
+        if (curr_node->down) {
+            push_node(worklist, get_ref(automaton, curr_node));
+        }
+    }
+}
+
+/* Add a node to the top of worklist */
+void push_node(worklist_t *worklist, ref_t ref) {
+    if (worklist->num == worklist->max) {
+        worklist->max = worklist->max ? worklist->max * INT_TWO : INIT_SLOTS;
+        worklist->refs = (ref_t *)realloc(worklist->refs, 
+                                          worklist->max * sizeof(ref_t));
+        assert(worklist->refs);
+    }
+    worklist->refs[worklist->num++] = ref;
+}
+
 /* Get number of compression for stage 2 using string array */
-int get_num_compress(void) {
-    int c, str_len = 0;   
-    char num_compress_str[INT_TEN];  
+int get_num_compress(reader_t *reader, writer_t *writer) {
+    int len;   
+    char *line, num_compress_str[NUM_MAX];  
     
-    while ((c = mygetchar()) != STMNT_END) {
-        if (c == EOF) exit(EXIT_FAILURE);
-        num_compress_str[str_len++] = c; 
+    int end = get_line(reader, &line, &len);
+    if (end == BAD_END) invalid_input(writer);
+    if (end == EOF) {
+        flush_writer(writer);
+        exit(EXIT_FAILURE);
     }
-    num_compress_str[str_len] = NUL_CH;
+    if (len >= NUM_MAX) len = NUM_MAX - INT_ONE;
+    memcpy(num_compress_str, line, len);
+    num_compress_str[len] = NUL_CH;
     return atoi(num_compress_str);
 }
 
 /* Add a string-less root node at the top of automaton */
 automaton_t *add_root(automaton_t *automaton) {
     assert(automaton);
-    node_t *newnode = get_new_node();
-    newnode->state->freq = automaton->total->statement;
+    node_t *newnode = get_new_node(automaton);
+    newnode->freq = automaton->total->statement;
     newnode->down = automaton->outputs->head;
-    automaton->outputs->head->up = newnode;
-    automaton->outputs->head = newnode;
+    automaton->outputs->head = get_ref(automaton, newnode);
     return automaton;
 }
 
 /* Delete 'y' node */
 void delete_node(automaton_t *automaton, node_t *x_node) {
-    node_t *y_node = x_node->down;
+    node_t *y_node = get_node(automaton, x_node->down);
+    node_t *z_node = get_node(automaton, y_node->down);
     
     /* Combine y's string with strings of its outgoing arcs on left side */ 
-    node_t *left_node = y_node->down->left;
+    node_t *left_node = get_node(automaton, z_node->left);
     while (left_node) {
-        left_node->str = combine_str(y_node->str, left_node->str); 
-        left_node = left_node->left;
+        combine_str(automaton, y_node, left_node, FALSE); 
+        left_node = get_node(automaton, left_node->left);
     }  
     /* Combine y's string with strings of its outgoing arcs on right side */
-    node_t *right_node = y_node->down->right;
+    node_t *right_node = get_node(automaton, z_node->right);
     while (right_node) {
-        right_node->str = combine_str(y_node->str, right_node->str);
-        right_node = right_node->right;
+        combine_str(automaton, y_node, right_node, FALSE);
+        right_node = get_node(automaton, right_node->right);
     }                
-    /* Reassign pointers after deleting 'y' node */
-    y_node->down->str = combine_str(y_node->str, y_node->down->str);
-    y_node->down->up = x_node;
+    /* Reassign links after deleting 'y' node */
+    uint32_t y_len = y_node->len, z_len = z_node->len;
+    combine_str(automaton, y_node, z_node, TRUE);
+    if (automaton->radix) {
+        join_chains(automaton->radix, x_node->down, y_node->down, 
+                    y_len - INT_ONE, z_len - INT_ONE, 
+                    (merged_t){y_node->freq, y_node->ends});
+    }
     x_node->down = y_node->down;
-    automaton->total->freq -= y_node->state->freq;
+    automaton->total->freq -= y_node->freq;
     automaton->total->state--;
-    free_node(y_node, INT_ZER);
-    check_visited(x_node, NULL);
-}
-
-/* Check for future possible and impossible visits */
-void check_visited(node_t *node, int *possible_visit) { 
-    /* Already visited node won't be traversed pass again */
-    if (!node->down) {
-        node->state->visited = TRUE; 
-    } else if (!node->down->down) {
-        /* Visit is still possible if current node has a side-way node */
-        if ((node->down->left && !node->down->left->state->visited) || 
-           (node->down->right && !node->down->right->state->visited)) {
-            if (possible_visit) *possible_visit = TRUE;
-        } else {
-            node->state->visited = TRUE; 
-        } 
-        node->down->state->visited = TRUE;
-    /* Visit is still possible if current node has a below node */
-    } else {
-        if (possible_visit) *possible_visit = TRUE;
-    }
-}
-
-/* Check for potential visit/compression while traversing automaton */
-node_t *traverse_automaton(node_t *x_node, int direction, int *new_node) {
-    node_t *curr_node = NULL;
-
-    /* Loop through un-visited nodes in either left or right direction 
-    to find node with smallest string in terms of ascii order */
-    if (direction == LEFT) {
-        curr_node = x_node->down->left;
-        while (curr_node->left && !curr_node->left->state->visited){
-            curr_node = curr_node->left;
-        }
-    } else if (direction == RIGHT) {
-        curr_node = x_node->down->right;
-        while (curr_node->right && !curr_node->right->state->visited){
-            curr_node = curr_node->right;
-        }
-    }
-    check_visited(curr_node, new_node);
-
-    /* Assign x_node to potential current node */
-    if (*new_node) x_node = curr_node;
-    /* If all current nodes has been visited, traverse to opposite side */
-    while (!(*new_node)) {
-        if (direction == LEFT) curr_node = curr_node->right;
-        if (direction == RIGHT) curr_node = curr_node->left;
-        /* If still no potential x_node found, break */
-        if (curr_node == x_node->down) break;
-        check_visited(curr_node, new_node);
-    }
-    return x_node;
+    /* Text below every other node reads the same after merging */
+    forget_completion(automaton, get_ref(automaton, y_node));
+    free_node(automaton, y_node);
 }
 
 /* Freeing memory space functions ********************************************/
-/* Free automaton */
+/* Free automaton by releasing pools and string arena at once */
 void free_automaton(automaton_t *automaton) {
     assert(automaton);
-    automaton->outputs->head = automaton->outputs->head->up;
-    while (automaton->outputs->head) {
-        recursive_free_left(automaton, automaton->outputs->head);
-    }
+    release_nodes(automaton->memory);
+    free(automaton->memory);
+    free_memo(automaton->memo);
+    free_path(automaton->path);
+    if (automaton->frozen) free_frozen(automaton->frozen);
+    if (automaton->radix) free_radix(automaton->radix);
+    if (automaton->ranks) free_ranks(automaton->ranks);
     free(automaton->total);
     free(automaton->outputs);
     free(automaton);
 }
 
-/* Free each node recursively, starting at left-hand side */
-static void recursive_free_left(automaton_t *automaton, node_t *root) {
-    if (!root) return;
-    if (root->down) recursive_free_left(automaton, root->down);
-    if (root->left) recursive_free_left(automaton, root->left);
-    if (root->right && (root->left || root->up || root->down)) {
-         recursive_free_right(automaton, root->right);
-    }
-    if (root == automaton->outputs->head) {
-        free_node(root, INT_ZER);
-        automaton->outputs->head = automaton->outputs->tail = NULL;
-        return;
+/* Release pools and string arena at once, or the snapshot they are mapped 
+from */
+void release_nodes(memory_t *memory) {
+    if (memory->map) {
+        munmap(memory->map, memory->map_size);
+    } else {
+        free(memory->nodes.slots);
+        free(memory->smalls.slots);
+        free(memory->bigs.slots);
+        free(memory->chars);
     }
-    free_node(root, INT_ONE);
 }
 
-/* Free each node recursively, starting at right-hand side */
-static void recursive_free_right(automaton_t *automaton, node_t *root) {
-    if (!root) return;
-    if (root->down) recursive_free_right(automaton, root->down);
-    if (root->right) recursive_free_right(automaton, root->right);
-    if (root->left && (root->right || root->up || root->down)) {
-        recursive_free_left(automaton, root->left);
-    }
-    if (root == automaton->outputs->head) {
-        free_node(root, INT_ZER);
-        automaton->outputs->head = automaton->outputs->tail = NULL;
-        return;
-    }
-    free_node(root, INT_ONE);
+/* Free freq of merged nodes */
+void free_radix(radix_t *radix) {
+    for (uint32_t i = 0; i < radix->max; i++) free(radix->chains[i]);
+    free(radix->chains);
+    free(radix->chars);
+    free(radix);
 }
 
-/* Free each node */
-void free_node(node_t *p1, int free_surround) {
-    if (free_surround) null_surrounding_nodes(p1);
-    free(p1->state);
-    free(p1->str);
-    free(p1);
-    p1 = NULL;
+/* Free frozen automaton */
+void free_frozen(frozen_t *frozen) {
+    free(frozen->cells);
+    free(frozen->chars);
+    free(frozen);
 }
 
-/* Null surrounding nodes */
-void null_surrounding_nodes(node_t *p1) {
-    if (p1->up) p1->up->down = NULL;
-    if (p1->left) p1->left->right = NULL;
-    if (p1->right) p1->right->left = NULL;
-    if (p1->down) p1->down->up = NULL;
+/* Return a node, its lookup and its string for reuse */
+void free_node(automaton_t *automaton, node_t *p1) {
+    free_str(automaton, p1);
+    free_lookup(automaton, p1->lookup);
+    pool_release(&automaton->memory->nodes, get_ref(automaton, p1));
 }
 
 /******************************************************************************